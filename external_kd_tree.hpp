@@ -0,0 +1,771 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <array>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "kd_simd.hpp"
+#include "static_kd_tree.hpp"
+
+// 外存KD树文件头，占据第0页，之后每一页都按pageSize对齐，均为本机字节序
+// 页分为叶子页和目录页：叶子页存放点，目录页存放若干孩子页的包围盒、页号和点数
+struct KDExternalHeader {
+    char magic[8];          // "KDTEXTM\0"
+    uint32_t formatVersion; // 文件格式版本
+    uint32_t byteOrder;     // 写入0x01020304，用于识别字节序
+    uint32_t coordSize;     // sizeof(T)
+    uint32_t coordKind;     // 与快照相同：0: 无符号整数, 1: 有符号整数, 2: 浮点数
+    uint32_t dims;          // K
+    uint32_t pageSize;      // 页大小，4096的倍数
+    uint64_t pointCount;
+    uint64_t pageCount;     // 包括文件头所在的第0页
+    uint64_t rootPage;      // 根页的页号，空树为0
+    uint32_t rootLevel;     // 根页的层号，0表示根就是叶子页
+    uint32_t reserved;
+};
+
+// 每一页开头的页头
+struct KDExternalPageHeader {
+    uint32_t level;         // 0为叶子页，目录页为其孩子的层号+1
+    uint32_t count;         // 叶子页为点数，目录页为孩子数
+    uint64_t reserved;
+};
+
+static constexpr char KD_EXTERNAL_MAGIC[8] = {'K', 'D', 'T', 'E', 'X', 'T', 'M', '\0'};
+static constexpr uint32_t KD_EXTERNAL_VERSION = 1;
+
+// 页缓存的统计
+struct KDPageCacheStats {
+    uint64_t hits = 0;      // 在缓存或固定页中找到的次数
+    uint64_t misses = 0;    // 需要从文件读取的次数
+    uint64_t pagesRead = 0; // 从文件读取的页数，包括预读
+    uint64_t reads = 0;     // 读文件的系统调用次数，连续的页合并为一次
+};
+
+// 外存KD树类模板
+// 建树时数据不必全部放入内存：先把输入顺序写入临时文件，超过内存上限的区段在文件上
+// 按抽样得到的中位数流式划分（两个临时文件来回交替），直到区段能放入内存，
+// 再在内存中划分为若干满页的叶子，按KD顺序写出；目录页随叶子一起自底向上生成
+// 查询时根附近的若干层目录常驻内存，其余页经由容量有限的LRU页缓存按需读入，
+// 需要访问的相邻叶子页合并为一次preadv读取；查询可以多线程并发进行
+// 叶子页内的点按中点隐式布局排列（与StaticKDTree相同），点数较少的区间直接扫描
+// 剪枝只依赖目录中记录的包围盒，划分值取近似中位数不影响结果的正确性
+// 文件建好后只读，需要更新时重新build；读写文件使用pread/preadv，仅支持Linux
+template <typename T, size_t K>
+class ExternalKDTree {
+private:
+    using Point = std::array<T, K>;
+
+    struct Box {
+        Point low;
+        Point high;
+    };
+
+    // 目录页中的一项，对应一个孩子页
+    struct Entry {
+        Box box;
+        uint64_t page;
+        uint64_t points;    // 孩子页为根的子树中的点数
+    };
+
+    // 内存中的一页，按8字节对齐
+    struct Page {
+        std::vector<uint64_t> words;
+        const KDExternalPageHeader& header() const { return *reinterpret_cast<const KDExternalPageHeader*>(words.data()); }
+        const Point* points() const { return reinterpret_cast<const Point*>(words.data() + sizeof(KDExternalPageHeader) / 8); }
+        const Entry* entries() const { return reinterpret_cast<const Entry*>(words.data() + sizeof(KDExternalPageHeader) / 8); }
+    };
+    using PagePtr = std::shared_ptr<const Page>;
+
+    // 范围查找结果的接收器，block接收整页完全包含的点
+    struct VectorSink {
+        std::vector<Point>& results;
+        void point(const Point& p) { results.push_back(p); }
+        void block(const Point* first, size_t count) { results.insert(results.end(), first, first + count); }
+    };
+
+    template <typename Callback>
+    struct CallbackSink {
+        Callback& callback;
+        void point(const Point& p) { callback(p); }
+        void block(const Point* first, size_t count) {
+            for (size_t i = 0; i < count; ++i) callback(first[i]);
+        }
+    };
+
+    // 一个临时文件中的一段连续的点，offset以点为单位
+    struct Segment {
+        int file;
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    // 建树时的状态，建树结束后释放
+    struct Builder {
+        int out = -1;
+        int scratch[2] = {-1, -1};
+        uint64_t nextPage = 1;
+        uint64_t pointCount = 0;
+        // 每一层尚未写出的目录项，levels[0]为叶子页的目录项
+        std::vector<std::vector<Entry>> levels;
+        std::vector<char> pageBuffer;
+        std::vector<Point> points;      // 能放入内存的区段
+        std::vector<Point> readBuffer, leftBuffer, rightBuffer;
+        bool ok = true;
+    };
+
+    int fd;
+    KDExternalHeader header;
+    size_t memoryLimit;
+    size_t pageSize;
+    size_t pinnedLevels;
+    // 常驻内存的上层页
+    std::unordered_map<uint64_t, PagePtr> pinned;
+    size_t pinnedBytes;
+
+    // LRU页缓存，最近使用的在链表头部
+    mutable std::mutex cacheMutex;
+    mutable std::list<std::pair<uint64_t, PagePtr>> lru;
+    mutable std::unordered_map<uint64_t, typename std::list<std::pair<uint64_t, PagePtr>>::iterator> cacheIndex;
+    size_t cacheCapacity;   // 页数
+    mutable std::atomic<uint64_t> cacheHits, cacheMisses, pagesRead, readCalls;
+
+    size_t leafCapacity() const { return (pageSize - sizeof(KDExternalPageHeader)) / sizeof(Point); }
+    size_t directoryCapacity() const { return (pageSize - sizeof(KDExternalPageHeader)) / sizeof(Entry); }
+
+    static bool readFull(int file, void* data, size_t bytes, uint64_t offset);
+    static bool writeFull(int file, const void* data, size_t bytes, uint64_t offset);
+
+    static void layoutLeaf(Point* first, size_t count, int depth);
+    static Box boundingBox(const Point* first, size_t count);
+    int sampleSplit(Builder& b, const Segment& seg, T& pivot) const;
+    void partitionSegment(Builder& b, const Segment& seg);
+    void buildInMemory(Builder& b, Point* first, size_t count);
+    void writeLeaf(Builder& b, Point* first, size_t count);
+    void addEntry(Builder& b, size_t level, const Entry& entry);
+    void writeDirectory(Builder& b, size_t level);
+
+    PagePtr readPage(uint64_t page) const;
+    PagePtr fetch(uint64_t page) const;
+    void insertCache(uint64_t page, const PagePtr& data) const;
+    bool cached(uint64_t page) const;
+    void readAhead(const std::vector<std::pair<uint64_t, bool>>& children) const;
+    template <size_t Axis, typename Sink>
+    void leafSearch(const Point* pts, size_t count, const Point& low, const Point& high, Sink& sink) const;
+    template <typename Sink>
+    void rangeSearchPage(uint64_t page, const Point& low, const Point& high, bool contained, Sink& sink) const;
+
+public:
+    static constexpr size_t DEFAULT_PAGE_SIZE = size_t(64) << 10;
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = size_t(256) << 20;
+    static constexpr size_t DEFAULT_PINNED_LEVELS = 2;
+    // 叶子页内点数不超过该值的区间直接扫描
+    static constexpr size_t LEAF_SCAN = 16;
+    // 抽样选取划分值时读取的位置数和每处连续读取的点数
+    static constexpr size_t SAMPLE_READS = 256;
+    static constexpr size_t SAMPLE_RUN = 16;
+    // 一次预读合并的最多页数
+    static constexpr size_t MAX_READ_AHEAD = 32;
+
+    ExternalKDTree();
+    ~ExternalKDTree();
+
+    ExternalKDTree(const ExternalKDTree&) = delete;
+    ExternalKDTree& operator=(const ExternalKDTree&) = delete;
+
+    // 内存上限：建树时为内存中的区段和划分缓冲区的大小，查询时为固定页和页缓存的总大小
+    void setMemoryLimit(size_t bytes) { memoryLimit = bytes; }
+    // 页大小只在建树时使用，向上取整到4096的倍数；打开文件时以文件头为准
+    void setPageSize(size_t bytes) { pageSize = std::max<size_t>(4096, (bytes + 4095) / 4096 * 4096); }
+    // 打开文件后常驻内存的目录层数，不超过内存上限的一半
+    void setPinnedLevels(size_t levels) { pinnedLevels = levels; }
+
+    // 从source逐批读取点，在path建立外存KD树文件，然后以该文件打开
+    // source(std::vector<Point>& batch)向batch追加下一批点，没有更多点时返回false
+    template <typename Source>
+    bool build(Source&& source, const std::string& path);
+
+    // 打开已建好的文件，坐标类型、维数与T、K不符时返回false
+    bool open(const std::string& path);
+    void close();
+
+    bool search(const Point& p) const { return rangeCount(p, p) > 0; }
+    std::vector<Point> rangeSearch(const Point& low, const Point& high) const;
+    template <typename Callback>
+    void rangeVisit(const Point& low, const Point& high, Callback&& callback) const;
+    size_t rangeCount(const Point& low, const Point& high) const;
+
+    size_t size() const { return header.pointCount; }
+    bool empty() const { return header.pointCount == 0; }
+    size_t pageCount() const { return header.pageCount; }
+    // 当前占用的内存：常驻页和缓存中的页
+    size_t memoryBytes() const;
+    KDPageCacheStats cacheStats() const;
+};
+
+template <typename T, size_t K>
+ExternalKDTree<T, K>::ExternalKDTree()
+    : fd(-1), memoryLimit(DEFAULT_MEMORY_LIMIT), pageSize(DEFAULT_PAGE_SIZE), pinnedLevels(DEFAULT_PINNED_LEVELS),
+      pinnedBytes(0), cacheCapacity(0), cacheHits(0), cacheMisses(0), pagesRead(0), readCalls(0) {
+    std::memset(&header, 0, sizeof(header));
+}
+
+template <typename T, size_t K>
+ExternalKDTree<T, K>::~ExternalKDTree() {
+    close();
+}
+
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    std::memset(&header, 0, sizeof(header));
+    pinned.clear();
+    pinnedBytes = 0;
+    lru.clear();
+    cacheIndex.clear();
+}
+
+template <typename T, size_t K>
+bool ExternalKDTree<T, K>::readFull(int file, void* data, size_t bytes, uint64_t offset) {
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t n = pread(file, p, bytes, offset);
+        if (n <= 0) return false;
+        p += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+
+template <typename T, size_t K>
+bool ExternalKDTree<T, K>::writeFull(int file, const void* data, size_t bytes, uint64_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t n = pwrite(file, p, bytes, offset);
+        if (n <= 0) return false;
+        p += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// 建树，外部接口
+// 第一遍把输入顺序写入临时文件，之后每一遍把过大的区段划分为两半写入另一个临时文件，
+// 每个点在划分阶段被读写O(log(n / 内存上限))次
+template <typename T, size_t K>
+template <typename Source>
+bool ExternalKDTree<T, K>::build(Source&& source, const std::string& path) {
+    static_assert(std::is_trivially_copyable<Point>::value, "external tree requires trivially copyable coordinates");
+    close();
+    if (directoryCapacity() < 2 || leafCapacity() < 1) return false;
+
+    Builder b;
+    b.out = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (b.out < 0) return false;
+    // 临时文件打开后立即删除，进程退出时自动回收
+    for (int i = 0; i < 2; ++i) {
+        std::string scratchPath = path + ".part" + std::to_string(i);
+        b.scratch[i] = ::open(scratchPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (b.scratch[i] >= 0) unlink(scratchPath.c_str());
+    }
+    b.pageBuffer.assign(pageSize, 0);
+
+    b.ok = b.scratch[0] >= 0 && b.scratch[1] >= 0;
+    {
+        std::vector<Point> batch;
+        bool more = b.ok;
+        while (more && b.ok) {
+            batch.clear();
+            more = source(batch);
+            b.ok = writeFull(b.scratch[0], batch.data(), batch.size() * sizeof(Point), b.pointCount * sizeof(Point));
+            b.pointCount += batch.size();
+        }
+    }
+    if (b.ok && b.pointCount > 0) partitionSegment(b, Segment{0, 0, b.pointCount});
+
+    // 自底向上写出各层剩余的目录项，直到某一层只剩一项且更高层为空，该项即为根
+    KDExternalHeader h;
+    std::memset(&h, 0, sizeof(h));
+    for (size_t level = 0; b.ok && level < b.levels.size(); ++level) {
+        bool higherEmpty = true;
+        for (size_t l = level + 1; l < b.levels.size(); ++l) higherEmpty = higherEmpty && b.levels[l].empty();
+        if (b.levels[level].size() == 1 && higherEmpty) {
+            h.rootPage = b.levels[level][0].page;
+            h.rootLevel = static_cast<uint32_t>(level);
+            break;
+        }
+        if (!b.levels[level].empty()) writeDirectory(b, level);
+    }
+
+    std::memcpy(h.magic, KD_EXTERNAL_MAGIC, sizeof(h.magic));
+    h.formatVersion = KD_EXTERNAL_VERSION;
+    h.byteOrder = 0x01020304;
+    h.coordSize = sizeof(T);
+    h.coordKind = snapshotCoordKind<T>();
+    h.dims = K;
+    h.pageSize = static_cast<uint32_t>(pageSize);
+    h.pointCount = b.pointCount;
+    h.pageCount = b.nextPage;
+    std::fill(b.pageBuffer.begin(), b.pageBuffer.end(), 0);
+    std::memcpy(b.pageBuffer.data(), &h, sizeof(h));
+    b.ok = b.ok && writeFull(b.out, b.pageBuffer.data(), pageSize, 0);
+
+    for (int i = 0; i < 2; ++i) {
+        if (b.scratch[i] >= 0) ::close(b.scratch[i]);
+    }
+    b.ok = (::close(b.out) == 0) && b.ok;
+    return b.ok && open(path);
+}
+
+// 从区段中抽样，返回包围盒最宽的维度，pivot为样本在该维度上的中位数
+template <typename T, size_t K>
+int ExternalKDTree<T, K>::sampleSplit(Builder& b, const Segment& seg, T& pivot) const {
+    std::vector<Point> sample;
+    std::vector<Point> run(SAMPLE_RUN);
+    uint64_t stride = seg.count / SAMPLE_READS;
+    for (size_t i = 0; i < SAMPLE_READS && b.ok; ++i) {
+        uint64_t at = seg.offset + i * stride;
+        size_t n = static_cast<size_t>(std::min<uint64_t>(SAMPLE_RUN, seg.offset + seg.count - at));
+        b.ok = readFull(b.scratch[seg.file], run.data(), n * sizeof(Point), at * sizeof(Point));
+        sample.insert(sample.end(), run.begin(), run.begin() + n);
+    }
+
+    Box box = boundingBox(sample.data(), sample.size());
+    int axis = 0;
+    for (size_t d = 1; d < K; ++d) {
+        if (box.high[d] - box.low[d] > box.high[axis] - box.low[axis]) axis = static_cast<int>(d);
+    }
+    auto mid = sample.begin() + sample.size() / 2;
+    std::nth_element(sample.begin(), mid, sample.end(), [axis](const Point& a, const Point& c) { return a[axis] < c[axis]; });
+    pivot = (*mid)[axis];
+    return axis;
+}
+
+// 区段能放入内存时读入内存建树，否则按抽样中位数划分到另一个临时文件的同一位置，再分别处理两半
+// 左半从区段开头向后写，右半从区段末尾向前写；等于划分值的点分给当前较少的一侧，
+// 重复值很多时两半也大致均衡
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::partitionSegment(Builder& b, const Segment& seg) {
+    if (!b.ok) return;
+    if (seg.count * sizeof(Point) <= memoryLimit / 2 || seg.count <= leafCapacity()) {
+        b.points.resize(seg.count);
+        b.ok = readFull(b.scratch[seg.file], b.points.data(), seg.count * sizeof(Point), seg.offset * sizeof(Point));
+        if (b.ok) buildInMemory(b, b.points.data(), seg.count);
+        return;
+    }
+
+    T pivot;
+    int axis = sampleSplit(b, seg, pivot);
+    // 内存上限的一半用于读缓冲区，另一半为左右两个写缓冲区
+    size_t bufferPoints = std::max<size_t>(1024, memoryLimit / 4 / sizeof(Point));
+    b.readBuffer.resize(bufferPoints);
+    b.leftBuffer.clear();
+    b.rightBuffer.clear();
+    b.leftBuffer.reserve(bufferPoints / 2);
+    b.rightBuffer.reserve(bufferPoints / 2);
+
+    int in = b.scratch[seg.file], out = b.scratch[1 - seg.file];
+    uint64_t leftCount = 0, rightCount = 0;
+    auto flushLeft = [&] {
+        b.ok = b.ok && writeFull(out, b.leftBuffer.data(), b.leftBuffer.size() * sizeof(Point),
+                                 (seg.offset + leftCount - b.leftBuffer.size()) * sizeof(Point));
+        b.leftBuffer.clear();
+    };
+    auto flushRight = [&] {
+        b.ok = b.ok && writeFull(out, b.rightBuffer.data(), b.rightBuffer.size() * sizeof(Point),
+                                 (seg.offset + seg.count - rightCount) * sizeof(Point));
+        b.rightBuffer.clear();
+    };
+    for (uint64_t pos = 0; pos < seg.count && b.ok; pos += bufferPoints) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(bufferPoints, seg.count - pos));
+        b.ok = readFull(in, b.readBuffer.data(), n * sizeof(Point), (seg.offset + pos) * sizeof(Point));
+        for (size_t i = 0; i < n && b.ok; ++i) {
+            const Point& p = b.readBuffer[i];
+            bool left = p[axis] < pivot || (!(pivot < p[axis]) && leftCount <= rightCount);
+            if (left) {
+                b.leftBuffer.push_back(p);
+                ++leftCount;
+                if (b.leftBuffer.size() == b.leftBuffer.capacity()) flushLeft();
+            } else {
+                b.rightBuffer.push_back(p);
+                ++rightCount;
+                if (b.rightBuffer.size() == b.rightBuffer.capacity()) flushRight();
+            }
+        }
+    }
+    flushLeft();
+    flushRight();
+    if (!b.ok) return;
+
+    // 样本极度偏斜时可能有一侧为空，此时按位置对半分，包围盒仍由实际的点算出
+    if (leftCount == 0 || rightCount == 0) leftCount = seg.count / 2;
+    partitionSegment(b, Segment{1 - seg.file, seg.offset, leftCount});
+    partitionSegment(b, Segment{1 - seg.file, seg.offset + leftCount, seg.count - leftCount});
+}
+
+// 在内存中划分为叶子页：左侧取leaves / 2个满页，除最后一页外每页都是满的
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::buildInMemory(Builder& b, Point* first, size_t count) {
+    if (!b.ok || count == 0) return;
+    size_t capacity = leafCapacity();
+    if (count <= capacity) {
+        writeLeaf(b, first, count);
+        return;
+    }
+    size_t leaves = (count + capacity - 1) / capacity;
+    size_t leftCount = leaves / 2 * capacity;
+    Box box = boundingBox(first, count);
+    int axis = 0;
+    for (size_t d = 1; d < K; ++d) {
+        if (box.high[d] - box.low[d] > box.high[axis] - box.low[axis]) axis = static_cast<int>(d);
+    }
+    std::nth_element(first, first + leftCount, first + count, [axis](const Point& a, const Point& c) { return a[axis] < c[axis]; });
+    buildInMemory(b, first, leftCount);
+    buildInMemory(b, first + leftCount, count - leftCount);
+}
+
+template <typename T, size_t K>
+typename ExternalKDTree<T, K>::Box ExternalKDTree<T, K>::boundingBox(const Point* first, size_t count) {
+    Box box{first[0], first[0]};
+    for (size_t i = 1; i < count; ++i) {
+        for (size_t d = 0; d < K; ++d) {
+            box.low[d] = std::min(box.low[d], first[i][d]);
+            box.high[d] = std::max(box.high[d], first[i][d]);
+        }
+    }
+    return box;
+}
+
+// 叶子页内的中点隐式布局，分割维度为depth % K
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::layoutLeaf(Point* first, size_t count, int depth) {
+    if (count <= LEAF_SCAN) return;
+    size_t mid = count / 2;
+    int axis = depth % K;
+    std::nth_element(first, first + mid, first + count, [axis](const Point& a, const Point& c) { return a[axis] < c[axis]; });
+    layoutLeaf(first, mid, depth + 1);
+    layoutLeaf(first + mid + 1, count - mid - 1, depth + 1);
+}
+
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::writeLeaf(Builder& b, Point* first, size_t count) {
+    layoutLeaf(first, count, 0);
+    KDExternalPageHeader ph{0, static_cast<uint32_t>(count), 0};
+    std::fill(b.pageBuffer.begin(), b.pageBuffer.end(), 0);
+    std::memcpy(b.pageBuffer.data(), &ph, sizeof(ph));
+    std::memcpy(b.pageBuffer.data() + sizeof(ph), first, count * sizeof(Point));
+    uint64_t page = b.nextPage++;
+    b.ok = writeFull(b.out, b.pageBuffer.data(), pageSize, page * pageSize);
+    addEntry(b, 0, Entry{boundingBox(first, count), page, count});
+}
+
+// 加入一个目录项，某层攒满一页时写出目录页，并把该页的目录项加入上一层
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::addEntry(Builder& b, size_t level, const Entry& entry) {
+    if (b.levels.size() <= level) b.levels.resize(level + 1);
+    b.levels[level].push_back(entry);
+    if (b.levels[level].size() == directoryCapacity()) writeDirectory(b, level);
+}
+
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::writeDirectory(Builder& b, size_t level) {
+    std::vector<Entry> entries;
+    entries.swap(b.levels[level]);
+    Entry parent{entries[0].box, b.nextPage++, 0};
+    for (const Entry& e : entries) {
+        for (size_t d = 0; d < K; ++d) {
+            parent.box.low[d] = std::min(parent.box.low[d], e.box.low[d]);
+            parent.box.high[d] = std::max(parent.box.high[d], e.box.high[d]);
+        }
+        parent.points += e.points;
+    }
+    KDExternalPageHeader ph{static_cast<uint32_t>(level + 1), static_cast<uint32_t>(entries.size()), 0};
+    std::fill(b.pageBuffer.begin(), b.pageBuffer.end(), 0);
+    std::memcpy(b.pageBuffer.data(), &ph, sizeof(ph));
+    std::memcpy(b.pageBuffer.data() + sizeof(ph), entries.data(), entries.size() * sizeof(Entry));
+    b.ok = b.ok && writeFull(b.out, b.pageBuffer.data(), pageSize, parent.page * pageSize);
+    addEntry(b, level + 1, parent);
+}
+
+// 打开文件，外部接口
+// 按层读入根附近的目录页常驻内存，剩余的内存上限作为页缓存，至少容纳MAX_READ_AHEAD页
+template <typename T, size_t K>
+bool ExternalKDTree<T, K>::open(const std::string& path) {
+    close();
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) return false;
+
+    KDExternalHeader h;
+    off_t fileSize = lseek(file, 0, SEEK_END);
+    if (fileSize < static_cast<off_t>(sizeof(h)) || !readFull(file, &h, sizeof(h), 0)
+        || std::memcmp(h.magic, KD_EXTERNAL_MAGIC, sizeof(h.magic)) != 0
+        || h.formatVersion != KD_EXTERNAL_VERSION
+        || h.byteOrder != 0x01020304
+        || h.coordSize != sizeof(T)
+        || h.coordKind != snapshotCoordKind<T>()
+        || h.dims != K
+        || h.pageSize < 4096 || h.pageSize % 4096 != 0
+        || static_cast<uint64_t>(fileSize) / h.pageSize < h.pageCount
+        || h.rootPage >= h.pageCount
+        || (h.pointCount > 0) != (h.rootPage > 0)) {
+        ::close(file);
+        return false;
+    }
+    fd = file;
+    header = h;
+    pageSize = h.pageSize;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+    std::vector<uint64_t> level;
+    if (header.rootPage > 0 && header.rootLevel > 0) level.push_back(header.rootPage);
+    for (size_t depth = 0; depth < pinnedLevels && !level.empty(); ++depth) {
+        if (pinnedBytes + level.size() * pageSize > memoryLimit / 2) break;
+        std::vector<uint64_t> next;
+        for (uint64_t page : level) {
+            PagePtr data = readPage(page);
+            if (!data) {
+                close();
+                return false;
+            }
+            pinned[page] = data;
+            pinnedBytes += pageSize;
+            if (data->header().level > 1) {
+                for (uint32_t i = 0; i < data->header().count; ++i) next.push_back(data->entries()[i].page);
+            }
+        }
+        level.swap(next);
+    }
+    cacheCapacity = std::max(MAX_READ_AHEAD, (memoryLimit - std::min(memoryLimit, pinnedBytes)) / pageSize);
+    return true;
+}
+
+// 读取一页并校验页头，文件损坏时返回空指针
+template <typename T, size_t K>
+typename ExternalKDTree<T, K>::PagePtr ExternalKDTree<T, K>::readPage(uint64_t page) const {
+    std::shared_ptr<Page> data(new Page());
+    data->words.resize(pageSize / 8);
+    if (page == 0 || page >= header.pageCount || !readFull(fd, data->words.data(), pageSize, page * pageSize)) return nullptr;
+    const KDExternalPageHeader& ph = data->header();
+    size_t capacity = ph.level == 0 ? leafCapacity() : directoryCapacity();
+    if (ph.count > capacity) return nullptr;
+    ++pagesRead;
+    ++readCalls;
+    return data;
+}
+
+template <typename T, size_t K>
+bool ExternalKDTree<T, K>::cached(uint64_t page) const {
+    if (pinned.count(page)) return true;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return cacheIndex.count(page) > 0;
+}
+
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::insertCache(uint64_t page, const PagePtr& data) const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (cacheIndex.count(page)) return;
+    lru.emplace_front(page, data);
+    cacheIndex[page] = lru.begin();
+    while (lru.size() > cacheCapacity) {
+        cacheIndex.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+// 取一页：先查固定页，再查缓存，都没有时在锁外读文件
+template <typename T, size_t K>
+typename ExternalKDTree<T, K>::PagePtr ExternalKDTree<T, K>::fetch(uint64_t page) const {
+    auto it = pinned.find(page);
+    if (it != pinned.end()) {
+        ++cacheHits;
+        return it->second;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto found = cacheIndex.find(page);
+        if (found != cacheIndex.end()) {
+            lru.splice(lru.begin(), lru, found->second);
+            ++cacheHits;
+            return found->second->second;
+        }
+    }
+    ++cacheMisses;
+    PagePtr data = readPage(page);
+    if (data) insertCache(page, data);
+    return data;
+}
+
+// 预读即将访问的孩子页：页号连续且不在缓存中的若干页用一次preadv读入
+// 预读的页数不超过缓存容量的一半，避免把本次查询马上要用的页挤出缓存
+template <typename T, size_t K>
+void ExternalKDTree<T, K>::readAhead(const std::vector<std::pair<uint64_t, bool>>& children) const {
+    size_t budget = cacheCapacity / 2;
+    size_t i = 0;
+    while (i < children.size() && budget > 1) {
+        if (cached(children[i].first)) {
+            ++i;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < children.size() && j - i < std::min(budget, MAX_READ_AHEAD)
+               && children[j].first == children[j - 1].first + 1 && !cached(children[j].first)) {
+            ++j;
+        }
+        if (j - i > 1) {
+            std::vector<std::shared_ptr<Page>> pages(j - i);
+            std::vector<iovec> iov(j - i);
+            for (size_t k = 0; k < pages.size(); ++k) {
+                pages[k].reset(new Page());
+                pages[k]->words.resize(pageSize / 8);
+                iov[k].iov_base = pages[k]->words.data();
+                iov[k].iov_len = pageSize;
+            }
+            // 读取不完整时放弃预读，之后由fetch逐页读取
+            ssize_t n = preadv(fd, iov.data(), static_cast<int>(iov.size()), children[i].first * pageSize);
+            ++readCalls;
+            if (n == static_cast<ssize_t>(pages.size() * pageSize)) {
+                for (size_t k = 0; k < pages.size(); ++k) {
+                    const KDExternalPageHeader& ph = pages[k]->header();
+                    if (ph.count > (ph.level == 0 ? leafCapacity() : directoryCapacity())) continue;
+                    ++pagesRead;
+                    insertCache(children[i + k].first, pages[k]);
+                }
+            }
+            budget -= j - i;
+        }
+        i = j;
+    }
+}
+
+// 叶子页内按隐式布局递归查找，Axis为当前深度的分割维度
+template <typename T, size_t K>
+template <size_t Axis, typename Sink>
+void ExternalKDTree<T, K>::leafSearch(const Point* pts, size_t count, const Point& low, const Point& high,
+                                      Sink& sink) const {
+    constexpr size_t next = nextAxis<Axis, K>();
+    if (count <= LEAF_SCAN) {
+        for (size_t i = 0; i < count; ++i) {
+            if (boxContains(pts[i], low, high)) sink.point(pts[i]);
+        }
+        return;
+    }
+    size_t mid = count / 2;
+    const Point& point = pts[mid];
+    if (boxContains(point, low, high)) sink.point(point);
+    if (point[Axis] >= low[Axis]) leafSearch<next>(pts, mid, low, high, sink);
+    if (point[Axis] <= high[Axis]) leafSearch<next>(pts + mid + 1, count - mid - 1, low, high, sink);
+}
+
+// 递归查找以page为根的子树，contained表示子树已完全包含在查询框内
+// 目录页中与查询框相交的孩子先整体预读，再依次访问
+template <typename T, size_t K>
+template <typename Sink>
+void ExternalKDTree<T, K>::rangeSearchPage(uint64_t page, const Point& low, const Point& high,
+                                           bool contained, Sink& sink) const {
+    PagePtr data = fetch(page);
+    if (!data) return;
+    const KDExternalPageHeader& ph = data->header();
+    if (ph.level == 0) {
+        if (contained) sink.block(data->points(), ph.count);
+        else leafSearch<0>(data->points(), ph.count, low, high, sink);
+        return;
+    }
+
+    std::vector<std::pair<uint64_t, bool>> children;
+    for (uint32_t i = 0; i < ph.count; ++i) {
+        const Entry& e = data->entries()[i];
+        if (contained) {
+            children.push_back({e.page, true});
+        } else if (boxOverlaps(e.box.low, e.box.high, low, high)) {
+            children.push_back({e.page, boxInside(e.box.low, e.box.high, low, high)});
+        }
+    }
+    if (ph.level == 1 && children.size() > 1) readAhead(children);
+    for (const auto& child : children) rangeSearchPage(child.first, low, high, child.second, sink);
+}
+
+// 范围查找，外部接口
+template <typename T, size_t K>
+std::vector<typename ExternalKDTree<T, K>::Point> ExternalKDTree<T, K>::rangeSearch(const Point& low,
+                                                                                   const Point& high) const {
+    std::vector<Point> results;
+    VectorSink sink{results};
+    if (header.rootPage > 0) rangeSearchPage(header.rootPage, low, high, false, sink);
+    return results;
+}
+
+// 范围查找，每个命中的点依次传给callback，不生成中间数组，外部接口
+template <typename T, size_t K>
+template <typename Callback>
+void ExternalKDTree<T, K>::rangeVisit(const Point& low, const Point& high, Callback&& callback) const {
+    CallbackSink<Callback> sink{callback};
+    if (header.rootPage > 0) rangeSearchPage(header.rootPage, low, high, false, sink);
+}
+
+// 范围计数：完全包含在查询框内的孩子直接用目录项中的点数计数，不读取其页面
+// 只有部分相交的叶子页需要读入
+template <typename T, size_t K>
+size_t ExternalKDTree<T, K>::rangeCount(const Point& low, const Point& high) const {
+    if (header.rootPage == 0) return 0;
+    size_t count = 0;
+    auto counter = [&count](const Point&) { ++count; };
+    CallbackSink<decltype(counter)> sink{counter};
+    std::vector<uint64_t> stack{header.rootPage};
+    while (!stack.empty()) {
+        PagePtr data = fetch(stack.back());
+        stack.pop_back();
+        if (!data) continue;
+        const KDExternalPageHeader& ph = data->header();
+        if (ph.level == 0) {
+            leafSearch<0>(data->points(), ph.count, low, high, sink);
+            continue;
+        }
+        std::vector<std::pair<uint64_t, bool>> children;
+        for (uint32_t i = 0; i < ph.count; ++i) {
+            const Entry& e = data->entries()[i];
+            if (!boxOverlaps(e.box.low, e.box.high, low, high)) continue;
+            if (boxInside(e.box.low, e.box.high, low, high)) {
+                count += e.points;
+            } else {
+                children.push_back({e.page, false});
+            }
+        }
+        if (ph.level == 1 && children.size() > 1) readAhead(children);
+        for (auto it = children.rbegin(); it != children.rend(); ++it) stack.push_back(it->first);
+    }
+    return count;
+}
+
+template <typename T, size_t K>
+size_t ExternalKDTree<T, K>::memoryBytes() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return pinnedBytes + lru.size() * pageSize;
+}
+
+template <typename T, size_t K>
+KDPageCacheStats ExternalKDTree<T, K>::cacheStats() const {
+    KDPageCacheStats s;
+    s.hits = cacheHits;
+    s.misses = cacheMisses;
+    s.pagesRead = pagesRead;
+    s.reads = readCalls;
+    return s;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "ip_utils.hpp"
+#include "parallel.hpp"
+
+// 二进制IP列表文件头，之后是count条记录，记录格式由encoding决定：
+//   IP_RAW：每条为4/16字节的网络字节序地址，保持写入顺序
+//   IP_DELTA：地址按升序排列，每条为与前一个地址之差的LEB128变长整数，第一条与0相减
+//   IP_GROUPED：批量查询结果，共count个子网，每个子网为8字节命中数和命中地址的IP_RAW记录，
+//               命中数为IP_GROUP_INVALID表示该子网格式错误
+// 文件头和命中数为本机字节序，地址和变长整数与字节序无关
+struct IPBinaryHeader {
+    char magic[8];          // "IPSBIN\0\0"
+    uint32_t byteOrder;     // 写入0x01020304，用于识别字节序
+    uint16_t formatVersion; // 文件格式版本
+    uint8_t ipVersion;      // 4或6
+    uint8_t encoding;       // IPEncoding
+    uint64_t count;
+};
+
+enum IPEncoding : uint8_t {
+    IP_RAW = 0,
+    IP_DELTA = 1,
+    IP_GROUPED = 2,
+};
+
+static constexpr char IP_BINARY_MAGIC[8] = {'I', 'P', 'S', 'B', 'I', 'N', '\0', '\0'};
+static constexpr uint16_t IP_BINARY_VERSION = 1;
+static constexpr uint64_t IP_GROUP_INVALID = ~uint64_t(0);
+
+inline IPBinaryHeader makeIPBinaryHeader(int ipVersion, IPEncoding encoding, uint64_t count) {
+    IPBinaryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, IP_BINARY_MAGIC, sizeof(header.magic));
+    header.byteOrder = 0x01020304;
+    header.formatVersion = IP_BINARY_VERSION;
+    header.ipVersion = static_cast<uint8_t>(ipVersion);
+    header.encoding = encoding;
+    header.count = count;
+    return header;
+}
+
+// 内容是否以二进制IP文件的魔数开头，用于和文本格式区分
+inline bool isIPBinary(const char* data, size_t size) {
+    return size >= sizeof(IPBinaryHeader) && std::memcmp(data, IP_BINARY_MAGIC, sizeof(IP_BINARY_MAGIC)) == 0;
+}
+
+// 读取并校验文件头，魔数、字节序、版本或编码不符时返回false
+inline bool readIPBinaryHeader(const char* data, size_t size, IPBinaryHeader& header) {
+    if (!isIPBinary(data, size)) return false;
+    std::memcpy(&header, data, sizeof(header));
+    return header.byteOrder == 0x01020304 && header.formatVersion == IP_BINARY_VERSION
+        && (header.ipVersion == 4 || header.ipVersion == 6) && header.encoding <= IP_GROUPED;
+}
+
+// 把N字节的大端地址看作128位无符号整数，拆成高低两个uint64
+struct IPValue {
+    uint64_t hi, lo;
+};
+
+template <size_t N>
+inline IPValue bytesToValue(const std::array<uint8_t, N>& b) {
+    static_assert(N <= 16, "address longer than 128 bits");
+    IPValue v = {0, 0};
+    for (size_t i = 0; i < N; ++i) {
+        v.hi = (v.hi << 8) | (v.lo >> 56);
+        v.lo = (v.lo << 8) | b[i];
+    }
+    return v;
+}
+
+template <size_t N>
+inline std::array<uint8_t, N> valueToBytes(IPValue v) {
+    std::array<uint8_t, N> b;
+    for (size_t i = N; i-- > 0;) {
+        b[i] = static_cast<uint8_t>(v.lo);
+        v.lo = (v.lo >> 8) | (v.hi << 56);
+        v.hi >>= 8;
+    }
+    return b;
+}
+
+// 升序地址的差分变长编码，每次encode写入与上一个地址之差，返回写入的字节数
+// 128位的差最多占19字节；输入未排序时差会回绕，解码仍能还原，只是不再压缩
+template <size_t N>
+class DeltaEncoder {
+public:
+    static constexpr size_t MAX_BYTES = 19;
+
+    size_t encode(const std::array<uint8_t, N>& ip, uint8_t* out) {
+        IPValue cur = bytesToValue(ip);
+        uint64_t lo = cur.lo - prev.lo;
+        uint64_t hi = cur.hi - prev.hi - (cur.lo < prev.lo);
+        if constexpr (N <= 8) {
+            // 地址不足64位时差按N字节回绕，未排序的输入也不会编码出过长的整数
+            hi = 0;
+            if constexpr (N < 8) lo &= (uint64_t(1) << (8 * N)) - 1;
+        }
+        prev = cur;
+
+        size_t len = 0;
+        while (hi != 0 || lo >= 0x80) {
+            out[len++] = static_cast<uint8_t>(lo & 0x7F) | 0x80;
+            lo = (lo >> 7) | (hi << 57);
+            hi >>= 7;
+        }
+        out[len++] = static_cast<uint8_t>(lo);
+        return len;
+    }
+
+private:
+    IPValue prev = {0, 0};
+};
+
+template <size_t N>
+class DeltaDecoder {
+public:
+    // 从p开始解码一个地址并前移p，数据截断或变长整数过长时返回false
+    bool decode(const uint8_t*& p, const uint8_t* end, std::array<uint8_t, N>& ip) {
+        uint64_t lo = 0, hi = 0;
+        unsigned shift = 0;
+        while (true) {
+            if (p == end || shift >= 128) return false;
+            uint64_t byte = *p & 0x7F;
+            if (shift < 64) {
+                lo |= byte << shift;
+                if (shift > 57) hi |= byte >> (64 - shift);
+            } else {
+                hi |= byte << (shift - 64);
+            }
+            shift += 7;
+            if (!(*p++ & 0x80)) break;
+        }
+        prev.hi += hi + (prev.lo + lo < prev.lo);
+        prev.lo += lo;
+        ip = valueToBytes<N>(prev);
+        return true;
+    }
+
+private:
+    IPValue prev = {0, 0};
+};
+
+// 解析内存中的二进制IP列表（IP_RAW或IP_DELTA），文件头的IP版本必须与Codec一致
+// IP_RAW按块多线程转换，IP_DELTA只能顺序解码；数据不完整时返回false
+template <typename Codec>
+bool parseIPBinary(const char* data, size_t size, unsigned threads, std::vector<typename Codec::Point>& out) {
+    using Bytes = typename Codec::Bytes;
+    IPBinaryHeader header;
+    if (!readIPBinaryHeader(data, size, header) || header.ipVersion != Codec::version) return false;
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data) + sizeof(header);
+    const uint8_t* end = reinterpret_cast<const uint8_t*>(data) + size;
+    const uint64_t count = header.count;
+
+    if (header.encoding == IP_RAW) {
+        if (static_cast<uint64_t>(end - p) / sizeof(Bytes) < count) return false;
+        out.resize(count);
+        const size_t block = 1 << 16;
+        parallelFor((count + block - 1) / block, threads, [&](size_t b) {
+            size_t last = std::min<size_t>(count, (b + 1) * block);
+            for (size_t i = b * block; i < last; ++i) {
+                Bytes ip;
+                std::memcpy(ip.data(), p + i * sizeof(Bytes), sizeof(Bytes));
+                out[i] = Codec::fromBytes(ip);
+            }
+        });
+        return true;
+    }
+
+    if (header.encoding == IP_DELTA) {
+        // 每条记录至少1字节，据此先排除count明显错误的文件
+        if (static_cast<uint64_t>(end - p) < count) return false;
+        out.resize(count);
+        DeltaDecoder<sizeof(Bytes)> decoder;
+        for (uint64_t i = 0; i < count; ++i) {
+            Bytes ip;
+            if (!decoder.decode(p, end, ip)) return false;
+            out[i] = Codec::fromBytes(ip);
+        }
+        return true;
+    }
+    return false;
+}
+
+// 按批顺序解码二进制IP列表（IP_RAW或IP_DELTA），用于不必一次读入全部地址的场合
+template <typename Codec>
+class IPBinaryStream {
+public:
+    using Point = typename Codec::Point;
+
+    // 校验文件头，IP版本必须与Codec一致
+    bool open(const char* data, size_t size) {
+        if (!readIPBinaryHeader(data, size, header) || header.ipVersion != Codec::version
+            || (header.encoding != IP_RAW && header.encoding != IP_DELTA)) {
+            return false;
+        }
+        p = reinterpret_cast<const uint8_t*>(data) + sizeof(header);
+        end = reinterpret_cast<const uint8_t*>(data) + size;
+        remaining = header.count;
+        corrupt = false;
+        return true;
+    }
+
+    // 解码至多maxCount个地址追加到out，返回追加的个数；读完或数据不完整时返回0
+    size_t read(std::vector<Point>& out, size_t maxCount) {
+        using Bytes = typename Codec::Bytes;
+        size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, maxCount));
+        if (corrupt || n == 0) return 0;
+        if (header.encoding == IP_RAW && static_cast<uint64_t>(end - p) / sizeof(Bytes) < n) {
+            corrupt = true;
+            return 0;
+        }
+        out.reserve(out.size() + n);
+        for (size_t i = 0; i < n; ++i) {
+            Bytes ip;
+            if (header.encoding == IP_RAW) {
+                std::memcpy(ip.data(), p, sizeof(Bytes));
+                p += sizeof(Bytes);
+            } else if (!decoder.decode(p, end, ip)) {
+                corrupt = true;
+                return i;
+            }
+            out.push_back(Codec::fromBytes(ip));
+        }
+        remaining -= n;
+        return n;
+    }
+
+    // 数据在count条记录之前结束
+    bool failed() const { return corrupt; }
+    // 下一条记录的起始位置
+    const char* position() const { return reinterpret_cast<const char*>(p); }
+
+private:
+    IPBinaryHeader header;
+    const uint8_t* p = nullptr;
+    const uint8_t* end = nullptr;
+    uint64_t remaining = 0;
+    bool corrupt = false;
+    DeltaDecoder<sizeof(typename Codec::Bytes)> decoder;
+};
@@ -0,0 +1,553 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include "parallel.hpp"
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// 套接字地址：unix:<路径>为Unix域套接字；<端口>或<IPv4地址>:<端口>为TCP，只给端口时为127.0.0.1
+struct SocketAddress {
+    sockaddr_storage storage;
+    socklen_t length = 0;
+    std::string unixPath;  // Unix域套接字的路径，TCP时为空
+};
+
+inline bool parseSocketAddress(const std::string& text, SocketAddress& addr) {
+    std::memset(&addr.storage, 0, sizeof(addr.storage));
+    addr.unixPath.clear();
+    if (text.compare(0, 5, "unix:") == 0) {
+        sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&addr.storage);
+        std::string path = text.substr(5);
+        if (path.empty() || path.size() >= sizeof(un->sun_path)) return false;
+        un->sun_family = AF_UNIX;
+        std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        addr.length = sizeof(sockaddr_un);
+        addr.unixPath = path;
+        return true;
+    }
+
+    size_t colon = text.rfind(':');
+    std::string host = colon == std::string::npos ? "127.0.0.1" : text.substr(0, colon);
+    std::string port = colon == std::string::npos ? text : text.substr(colon + 1);
+    char* end = nullptr;
+    unsigned long number = std::strtoul(port.c_str(), &end, 10);
+    if (port.empty() || *end != '\0' || number == 0 || number > 65535) return false;
+    sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&addr.storage);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(static_cast<uint16_t>(number));
+    if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) return false;
+    addr.length = sizeof(sockaddr_in);
+    return true;
+}
+
+// 监听addr，返回非阻塞的套接字，失败返回-1；Unix域套接字已存在的文件会先删除
+inline int listenSocket(const SocketAddress& addr) {
+    int fd = socket(addr.storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (!addr.unixPath.empty()) {
+        unlink(addr.unixPath.c_str());
+    } else {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr.storage), addr.length) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// 连接addr，返回阻塞的套接字，失败返回-1；TCP连接关闭Nagle算法，流水线中的小请求不被延迟
+inline int connectSocket(const SocketAddress& addr) {
+    int fd = socket(addr.storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr.storage), addr.length) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (addr.unixPath.empty()) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// 常驻的查询服务：一个I/O线程用epoll处理所有连接的读写，请求交给工作线程池执行
+// 协议按行，每行一个请求；客户端可以连续发送多个请求而不等待回复（流水线），回复按请求顺序返回
+// 对端关闭写端时，最后一行即使没有换行符也作为请求处理
+// 同一连接上的请求依次执行：前一个请求的回复生成完毕后，下一个请求才交给工作线程，
+// 一个连接最多占用一个工作线程，不读回复的客户端不会占满线程池而拖住其他连接
+// 单个回复在生成过程中每满STREAM_CHUNK字节就交给I/O线程发送，大结果不必整个生成后再发送；
+// 回复中未发送的数据达到REPLY_LIMIT时，生成回复的工作线程等待I/O线程发出后再继续，
+// 慢速的客户端或很大的结果不会让服务端在内存中积压整个回复；连接关闭后回复被取消，不再等待
+// listen()成功后调用run()，run()一直运行到收到SIGINT或SIGTERM
+class QueryServer {
+public:
+    static constexpr size_t STREAM_CHUNK = size_t(64) << 10;
+    // 单个回复中尚未交给I/O线程的数据上限，超过后工作线程等待
+    static constexpr size_t REPLY_LIMIT = STREAM_CHUNK * 4;
+    // 每个连接最多排队等待执行的请求数，以及待发送字节数的上限，超过后暂停读取这个连接
+    static constexpr size_t MAX_PIPELINE = 1024;
+    static constexpr size_t OUTPUT_LIMIT = size_t(4) << 20;
+    // 单行请求的最大长度，超过时断开连接
+    static constexpr size_t MAX_REQUEST = 4096;
+
+    class ReplyStream;
+    using Handler = std::function<void(const std::string& request, ReplyStream& out)>;
+
+    QueryServer(Handler requestHandler, unsigned threadCount)
+        : handler(std::move(requestHandler)), threads(resolveThreads(threadCount)) {}
+
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+
+    // 监听addr，失败时返回false，errno为失败原因
+    bool listen(const SocketAddress& addr);
+    // 处理连接直到收到SIGINT或SIGTERM；无法创建epoll、eventfd或signalfd时返回false，errno为失败原因
+    bool run();
+
+    uint64_t requestCount() const { return requests; }
+    uint64_t connectionCount() const { return connections; }
+
+private:
+    // 单个请求的回复，工作线程写入data，I/O线程取走后发送
+    struct Reply {
+        std::mutex lock;
+        std::condition_variable drained;  // I/O线程取走数据或回复被取消时通知工作线程
+        std::string data;
+        bool done = false;
+        bool cancelled = false;           // 连接已关闭，之后的输出直接丢弃
+    };
+
+    struct Job {
+        uint64_t conn;
+        std::shared_ptr<Reply> reply;
+        std::string request;
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::string input;
+        size_t inputPos = 0;
+        std::deque<std::string> pending;  // 已收到、等待执行的请求，按顺序逐个交给工作线程
+        std::shared_ptr<Reply> active;    // 正在执行的请求的回复，同一连接同时只有一个
+        std::string output;
+        size_t outputPos = 0;
+        bool readClosed = false;
+        uint32_t events = 0;  // 当前在epoll中注册的事件
+        bool registered = false;
+    };
+
+    // epoll中前三个编号留给监听套接字、唤醒I/O线程的eventfd和信号
+    static constexpr uint64_t LISTEN_ID = 0, WAKE_ID = 1, SIGNAL_ID = 2;
+
+    void workerLoop();
+    bool publish(uint64_t conn, Reply& reply, std::string& data, bool done);
+    void acceptConnections();
+    void readInput(Connection& c);
+    bool parseRequests(uint64_t id, Connection& c);
+    void dispatch(uint64_t id, Connection& c);
+    bool collectReplies(uint64_t id, Connection& c);
+    bool writeOutput(Connection& c);
+    void updateEvents(uint64_t id, Connection& c);
+    void closeConnection(uint64_t id);
+    // 处理完一个连接的事件后调用，连接已关闭或出错时关闭它
+    void service(uint64_t id, Connection& c);
+
+    Handler handler;
+    unsigned threads;
+    int epollFd = -1, listenFd = -1, wakeFd = -1;
+    bool listenIsTcp = false;
+    std::string unixPath;
+    uint64_t nextId = SIGNAL_ID + 1;
+    std::unordered_map<uint64_t, Connection> conns;
+    uint64_t requests = 0, connections = 0;
+
+    std::mutex jobLock;
+    std::condition_variable jobReady;
+    std::deque<Job> jobs;
+    bool stopping = false;
+
+    // 有新回复数据的连接，工作线程写入，I/O线程取走
+    std::mutex completedLock;
+    std::vector<uint64_t> completed;
+};
+
+// 回复的输出流：handler把回复追加到buffer()，并在适当的时候调用flush()
+// flush()只在缓冲区满STREAM_CHUNK字节时才真正交给I/O线程，可以每输出一行就调用
+class QueryServer::ReplyStream {
+public:
+    std::string& buffer() { return local; }
+    // 客户端未及时读取时flush()会阻塞，直到回复中未发送的数据低于REPLY_LIMIT
+    // 连接已关闭时丢弃数据并返回false，handler可以就此停止生成回复
+    bool flush() {
+        return local.size() < STREAM_CHUNK || server.publish(conn, reply, local, false);
+    }
+    // 连接已关闭，handler可以提前结束
+    bool cancelled() {
+        std::lock_guard<std::mutex> guard(reply.lock);
+        return reply.cancelled;
+    }
+
+private:
+    friend class QueryServer;
+    ReplyStream(QueryServer& owner, uint64_t connId, Reply& target) : server(owner), conn(connId), reply(target) {}
+
+    QueryServer& server;
+    uint64_t conn;
+    Reply& reply;
+    std::string local;
+};
+
+inline void QueryServer::workerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(jobLock);
+            jobReady.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        ReplyStream out(*this, job.conn, *job.reply);
+        handler(job.request, out);
+        publish(job.conn, *job.reply, out.local, true);
+    }
+}
+
+// 把工作线程生成的一段回复交给连接，必要时唤醒I/O线程
+// 回复未完成时，等到未发送的数据低于REPLY_LIMIT或回复被取消再返回；回复已取消时返回false
+inline bool QueryServer::publish(uint64_t conn, Reply& reply, std::string& data, bool done) {
+    {
+        std::lock_guard<std::mutex> guard(reply.lock);
+        if (reply.cancelled) {
+            data.clear();
+            return false;
+        }
+        if (reply.data.empty()) reply.data.swap(data);
+        else reply.data += data;
+        reply.done = done;
+    }
+    data.clear();
+    bool wake;
+    {
+        std::lock_guard<std::mutex> guard(completedLock);
+        wake = completed.empty();
+        completed.push_back(conn);
+    }
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t n = write(wakeFd, &one, sizeof(one));
+        (void)n;
+    }
+    if (done) return true;
+    std::unique_lock<std::mutex> guard(reply.lock);
+    reply.drained.wait(guard, [&reply] { return reply.cancelled || reply.data.size() < REPLY_LIMIT; });
+    return !reply.cancelled;
+}
+
+inline void QueryServer::acceptConnections() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (listenIsTcp) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        uint64_t id = nextId++;
+        Connection& c = conns[id];
+        c.fd = fd;
+        ++connections;
+        updateEvents(id, c);
+    }
+}
+
+inline void QueryServer::readInput(Connection& c) {
+    char buf[65536];
+    while (c.input.size() - c.inputPos < MAX_PIPELINE * 64) {
+        ssize_t n = read(c.fd, buf, sizeof(buf));
+        if (n > 0) {
+            c.input.append(buf, n);
+        } else {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) c.readClosed = true;
+            return;
+        }
+    }
+}
+
+// 把已读入的完整行作为请求排队，连接上排队的请求或待发送的数据过多时暂停
+// 对端已关闭写端时，剩余的不完整行作为最后一个请求；请求行超过MAX_REQUEST时返回false
+inline bool QueryServer::parseRequests(uint64_t id, Connection& c) {
+    while (c.pending.size() < MAX_PIPELINE && c.output.size() - c.outputPos < OUTPUT_LIMIT
+           && c.inputPos < c.input.size()) {
+        const char* begin = c.input.data() + c.inputPos;
+        size_t remaining = c.input.size() - c.inputPos;
+        const char* newline = static_cast<const char*>(std::memchr(begin, '\n', remaining));
+        if (!newline && remaining > MAX_REQUEST) return false;
+        if (!newline && !c.readClosed) break;
+        size_t len = newline ? newline - begin : remaining;
+        c.inputPos += newline ? len + 1 : len;
+        if (len > 0 && begin[len - 1] == '\r') --len;
+        if (len == 0) continue;
+        c.pending.emplace_back(begin, len);
+        ++requests;
+    }
+    if (c.inputPos == c.input.size()) {
+        c.input.clear();
+        c.inputPos = 0;
+    } else if (c.inputPos > c.input.size() / 2) {
+        c.input.erase(0, c.inputPos);
+        c.inputPos = 0;
+    }
+    dispatch(id, c);
+    return true;
+}
+
+// 连接上没有正在执行的请求时，把下一个排队的请求交给工作线程
+inline void QueryServer::dispatch(uint64_t id, Connection& c) {
+    if (c.active || c.pending.empty()) return;
+    c.active = std::make_shared<Reply>();
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        jobs.push_back(Job{id, c.active, std::move(c.pending.front())});
+    }
+    c.pending.pop_front();
+    jobReady.notify_one();
+}
+
+// 把正在执行的请求已生成的回复移入发送缓冲区，回复完成时接着执行下一个请求，
+// 直到回复未完成或缓冲区中已有STREAM_CHUNK字节待发送为止
+// 取走数据后通知等待中的工作线程；有数据移入或有回复完成时返回true
+inline bool QueryServer::collectReplies(uint64_t id, Connection& c) {
+    bool progress = false;
+    while (c.active && c.output.size() - c.outputPos < STREAM_CHUNK) {
+        Reply& head = *c.active;
+        bool done;
+        {
+            std::lock_guard<std::mutex> guard(head.lock);
+            progress = progress || !head.data.empty() || head.done;
+            if (c.output.size() == c.outputPos) {
+                c.output.swap(head.data);
+                c.outputPos = 0;
+            } else {
+                c.output += head.data;
+            }
+            head.data.clear();
+            done = head.done;
+        }
+        head.drained.notify_all();
+        if (!done) break;
+        c.active.reset();
+        dispatch(id, c);
+    }
+    return progress;
+}
+
+// 尽量发送缓冲区中的数据，出错时返回false
+inline bool QueryServer::writeOutput(Connection& c) {
+    while (c.outputPos < c.output.size()) {
+        ssize_t n = send(c.fd, c.output.data() + c.outputPos, c.output.size() - c.outputPos, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.outputPos += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+    c.output.clear();
+    c.outputPos = 0;
+    return true;
+}
+
+// 排队的请求和待发送的数据都未超过上限时才继续读，有待发送的数据时等待可写
+inline void QueryServer::updateEvents(uint64_t id, Connection& c) {
+    uint32_t events = 0;
+    if (!c.readClosed && c.pending.size() < MAX_PIPELINE && c.output.size() - c.outputPos < OUTPUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (c.outputPos < c.output.size()) events |= EPOLLOUT;
+    if (c.registered && events == c.events) return;
+
+    // 事件为空时仍保持注册，等工作线程交回回复后再恢复
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = id;
+    epoll_ctl(epollFd, c.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &ev);
+    c.events = events;
+    c.registered = true;
+}
+
+// 关闭连接，取消正在执行的请求的回复，等待中的工作线程随即返回；排队的请求直接丢弃
+inline void QueryServer::closeConnection(uint64_t id) {
+    auto it = conns.find(id);
+    if (it == conns.end()) return;
+    if (const auto& reply = it->second.active) {
+        {
+            std::lock_guard<std::mutex> guard(reply->lock);
+            reply->cancelled = true;
+            reply->data.clear();
+        }
+        reply->drained.notify_all();
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    close(it->second.fd);
+    conns.erase(it);
+}
+
+inline void QueryServer::service(uint64_t id, Connection& c) {
+    bool valid = parseRequests(id, c);
+    collectReplies(id, c);
+    if (!valid || !writeOutput(c)) {
+        closeConnection(id);
+        return;
+    }
+    // 发送缓冲区发空后继续取下一段回复，直到套接字写满或没有新数据
+    while (c.outputPos == c.output.size() && collectReplies(id, c)) {
+        if (!writeOutput(c)) {
+            closeConnection(id);
+            return;
+        }
+    }
+    // 对端关闭写端后，把已收到的请求都回复完再关闭
+    if (c.readClosed && !c.active && c.pending.empty() && c.outputPos == c.output.size() && c.inputPos == c.input.size()) {
+        closeConnection(id);
+        return;
+    }
+    updateEvents(id, c);
+}
+
+inline bool QueryServer::listen(const SocketAddress& addr) {
+    listenFd = listenSocket(addr);
+    if (listenFd < 0) return false;
+    listenIsTcp = addr.unixPath.empty();
+    unixPath = addr.unixPath;
+    return true;
+}
+
+inline bool QueryServer::run() {
+    // 工作线程继承屏蔽的信号，SIGINT和SIGTERM只由I/O线程通过signalfd处理
+    sigset_t mask, oldMask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldMask);
+    int signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    auto addEvent = [this](int fd, uint64_t id) {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    };
+    if (signalFd < 0 || epollFd < 0 || wakeFd < 0 || !addEvent(listenFd, LISTEN_ID)
+        || !addEvent(wakeFd, WAKE_ID) || !addEvent(signalFd, SIGNAL_ID)) {
+        // 保留失败原因，关闭已创建的描述符
+        int error = errno;
+        for (int fd : {signalFd, epollFd, wakeFd, listenFd}) {
+            if (fd >= 0) close(fd);
+        }
+        epollFd = wakeFd = listenFd = -1;
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+        pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+        errno = error;
+        return false;
+    }
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back([this] { workerLoop(); });
+
+    std::vector<epoll_event> events(256);
+    std::vector<uint64_t> ready;
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                acceptConnections();
+            } else if (id == WAKE_ID) {
+                uint64_t count;
+                ssize_t r = read(wakeFd, &count, sizeof(count));
+                (void)r;
+                {
+                    std::lock_guard<std::mutex> guard(completedLock);
+                    ready.swap(completed);
+                }
+                for (uint64_t connId : ready) {
+                    auto it = conns.find(connId);
+                    if (it != conns.end()) service(connId, it->second);
+                }
+                ready.clear();
+            } else if (id == SIGNAL_ID) {
+                // 取走挂起的信号，恢复信号屏蔽后不会再按默认动作终止进程
+                signalfd_siginfo info;
+                ssize_t r = read(signalFd, &info, sizeof(info));
+                (void)r;
+                running = false;
+            } else {
+                auto it = conns.find(id);
+                if (it == conns.end()) continue;
+                Connection& c = it->second;
+                if (events[i].events & EPOLLIN) readInput(c);
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                    closeConnection(id);
+                    continue;
+                }
+                service(id, c);
+            }
+        }
+    }
+
+    // 先关闭连接取消所有回复，阻塞在publish中的工作线程才能退出
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        stopping = true;
+        jobs.clear();
+    }
+    jobReady.notify_all();
+    while (!conns.empty()) closeConnection(conns.begin()->first);
+    for (auto& th : pool) th.join();
+    close(listenFd);
+    close(wakeFd);
+    close(signalFd);
+    close(epollFd);
+    if (!unixPath.empty()) unlink(unixPath.c_str());
+    pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+    return true;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include "parallel.hpp"
+
+// 按字典序排序的地址数组，专用于CIDR查询
+// 打包或按字节表示的地址，其字典序都与地址的整数大小一致，一个CIDR恰好是一段连续区间，
+// 查询只需两次lower bound，命中的地址就是排序数组中连续的一段
+// 每BLOCK个点取一个样本，样本按Eytzinger布局（根为1，孩子为2k、2k+1）存放，
+// 顶层查找自上而下只访问连续的若干层，前几层总在缓存中，循环体中没有分支；
+// 再在样本之间的BLOCK个点中做无分支二分
+// 只能查询字典序上连续的区间[low, high]；一般的超矩形请使用KDTree
+template <typename T, size_t K>
+class SortedIPIndex {
+public:
+    using Point = std::array<T, K>;
+    static constexpr size_t BLOCK = 16;
+    // 点数不小于该值时分块多线程排序再归并
+    static constexpr size_t PARALLEL_SORT_MIN = size_t(1) << 16;
+
+    SortedIPIndex() : threads(1) {}
+
+    // 排序使用的线程数，0表示使用全部硬件线程，默认为1
+    void setThreads(unsigned threadCount) { threads = resolveThreads(threadCount); }
+
+    void build(const std::vector<Point>& pointList) { build(std::vector<Point>(pointList)); }
+    void build(std::vector<Point>&& pointList);
+    bool search(const Point& p) const;
+    std::vector<Point> rangeSearch(const Point& low, const Point& high) const;
+    template <typename Callback>
+    void rangeVisit(const Point& low, const Point& high, Callback&& callback) const;
+    size_t rangeCount(const Point& low, const Point& high) const;
+
+    size_t size() const { return points.size(); }
+    bool empty() const { return points.empty(); }
+    // 点、样本和样本序号占用的字节数
+    size_t memoryBytes() const {
+        return points.capacity() * sizeof(Point) + samples.capacity() * sizeof(Point) + sampleRank.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    void fillSamples(size_t& rank, size_t k);
+    // less(a, key)为真的点都排在前面，返回第一个使其为假的位置
+    template <typename Less>
+    size_t bound(const Point& key, Less less) const;
+    size_t lowerBound(const Point& key) const {
+        return bound(key, [](const Point& a, const Point& b) { return a < b; });
+    }
+    size_t upperBound(const Point& key) const {
+        return bound(key, [](const Point& a, const Point& b) { return !(b < a); });
+    }
+
+    std::vector<Point> points;
+    std::vector<Point> samples;       // Eytzinger布局，下标从1开始
+    std::vector<uint32_t> sampleRank; // samples[k]是第几个样本，即points[rank * BLOCK]
+    unsigned threads;
+};
+
+
+// 中序遍历Eytzinger树，依次填入样本
+template <typename T, size_t K>
+void SortedIPIndex<T, K>::fillSamples(size_t& rank, size_t k) {
+    if (k >= samples.size()) return;
+    fillSamples(rank, 2 * k);
+    samples[k] = points[rank * BLOCK];
+    sampleRank[k] = static_cast<uint32_t>(rank);
+    ++rank;
+    fillSamples(rank, 2 * k + 1);
+}
+
+template <typename T, size_t K>
+void SortedIPIndex<T, K>::build(std::vector<Point>&& pointList) {
+    points = std::move(pointList);
+    parallelSort(points.begin(), points.end(), points.size() < PARALLEL_SORT_MIN ? 1 : threads);
+
+    size_t sampleCount = (points.size() + BLOCK - 1) / BLOCK;
+    samples.assign(sampleCount + 1, Point());
+    sampleRank.assign(sampleCount + 1, 0);
+    size_t rank = 0;
+    fillSamples(rank, 1);
+}
+
+template <typename T, size_t K>
+template <typename Less>
+size_t SortedIPIndex<T, K>::bound(const Point& key, Less less) const {
+    // 顶层：找到第一个不满足less的样本，路径上每一步向左或向右由比较结果直接算出
+    size_t sampleCount = samples.size() - 1;
+    size_t k = 1;
+    while (k <= sampleCount) k = 2 * k + less(samples[k], key);
+    // 去掉最后一段连续向右的步骤，k回到答案所在的节点，全部向右时k为0
+    k >>= __builtin_ffsll(~k);
+    size_t rank = k == 0 ? sampleCount : sampleRank[k];
+    if (rank == 0) return 0;
+
+    // 答案在上一个样本之后、这个样本（含）之前
+    size_t first = (rank - 1) * BLOCK + 1;
+    size_t len = std::min(rank * BLOCK, points.size()) - first;
+    const Point* base = points.data() + first;
+    while (len > 1) {
+        size_t half = len / 2;
+        base = less(base[half - 1], key) ? base + half : base;
+        len -= half;
+    }
+    return (base - points.data()) + (len == 1 && less(*base, key));
+}
+
+template <typename T, size_t K>
+bool SortedIPIndex<T, K>::search(const Point& p) const {
+    size_t i = lowerBound(p);
+    return i < points.size() && points[i] == p;
+}
+
+template <typename T, size_t K>
+template <typename Callback>
+void SortedIPIndex<T, K>::rangeVisit(const Point& low, const Point& high, Callback&& callback) const {
+    if (high < low) return;
+    size_t first = lowerBound(low);
+    size_t last = upperBound(high);
+    for (size_t i = first; i < last; ++i) callback(points[i]);
+}
+
+template <typename T, size_t K>
+std::vector<std::array<T, K>> SortedIPIndex<T, K>::rangeSearch(const Point& low, const Point& high) const {
+    if (high < low) return {};
+    return std::vector<Point>(points.begin() + lowerBound(low), points.begin() + upperBound(high));
+}
+
+template <typename T, size_t K>
+size_t SortedIPIndex<T, K>::rangeCount(const Point& low, const Point& high) const {
+    if (high < low) return 0;
+    return upperBound(high) - lowerBound(low);
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "parallel.hpp"
+
+using IPv4Bytes = std::array<uint8_t, 4>;
+using IPv6Bytes = std::array<uint8_t, 16>;
+
+// 十六进制字符到数值的查表，非十六进制字符为-1
+struct HexTable {
+    int8_t value[256];
+    constexpr HexTable() : value() {
+        for (int i = 0; i < 256; ++i) value[i] = -1;
+        for (int i = 0; i < 10; ++i) value['0' + i] = i;
+        for (int i = 0; i < 6; ++i) {
+            value['a' + i] = 10 + i;
+            value['A' + i] = 10 + i;
+        }
+    }
+};
+static constexpr HexTable HEX_TABLE;
+
+// 解析点分十进制IPv4，[first, last)必须恰好是一个地址
+// 直接在原始字符上解析，不分配内存
+inline bool parseIPv4(const char* first, const char* last, IPv4Bytes& out) {
+    const char* p = first;
+    for (int i = 0; i < 4; ++i) {
+        unsigned v = 0;
+        int digits = 0;
+        while (p < last && digits < 3 && static_cast<unsigned>(*p - '0') < 10) {
+            v = v * 10 + (*p - '0');
+            ++p;
+            ++digits;
+        }
+        if (digits == 0 || v > 255) return false;
+        out[i] = static_cast<uint8_t>(v);
+        if (i < 3) {
+            if (p >= last || *p != '.') return false;
+            ++p;
+        }
+    }
+    return p == last;
+}
+
+// 解析IPv6，支持::连写的形式，[first, last)必须恰好是一个地址
+// 直接在原始字符上解析，不分配内存
+inline bool parseIPv6(const char* first, const char* last, IPv6Bytes& out) {
+    uint16_t groups[8];
+    int count = 0;
+    int gap = -1;  // ::所在位置（其前的组数），-1表示没有::
+    const char* p = first;
+
+    if (last - p >= 2 && p[0] == ':' && p[1] == ':') {
+        gap = 0;
+        p += 2;
+    }
+    while (p < last) {
+        unsigned v = 0;
+        int digits = 0;
+        int h;
+        while (p < last && (h = HEX_TABLE.value[static_cast<unsigned char>(*p)]) >= 0) {
+            v = (v << 4) | h;
+            ++p;
+            ++digits;
+        }
+        if (digits == 0 || digits > 4 || count == 8) return false;
+        groups[count++] = static_cast<uint16_t>(v);
+        if (p == last) break;
+        if (*p != ':' || ++p == last) return false;
+        if (*p == ':') {
+            if (gap >= 0) return false;
+            gap = count;
+            ++p;
+        }
+    }
+    if (gap < 0 ? count != 8 : count > 7) return false;
+
+    int zeros = 8 - count;
+    int idx = 0;
+    for (int g = 0; g < count; ++g) {
+        if (g == gap) {
+            for (int z = 0; z < zeros; ++z, ++idx) out[2 * idx] = out[2 * idx + 1] = 0;
+        }
+        out[2 * idx] = static_cast<uint8_t>(groups[g] >> 8);
+        out[2 * idx + 1] = static_cast<uint8_t>(groups[g] & 0xFF);
+        ++idx;
+    }
+    for (; idx < 8; ++idx) out[2 * idx] = out[2 * idx + 1] = 0;
+    return true;
+}
+
+// 字符串版本，格式错误时抛出std::invalid_argument
+inline IPv4Bytes parseIPv4(const std::string& ipStr) {
+    IPv4Bytes addr;
+    if (!parseIPv4(ipStr.data(), ipStr.data() + ipStr.size(), addr)) throw std::invalid_argument("bad IPv4: " + ipStr);
+    return addr;
+}
+
+inline IPv6Bytes parseIPv6(const std::string& ipStr) {
+    IPv6Bytes addr;
+    if (!parseIPv6(ipStr.data(), ipStr.data() + ipStr.size(), addr)) throw std::invalid_argument("bad IPv6: " + ipStr);
+    return addr;
+}
+
+// 把CIDR转换为子网的首地址start和末地址end，格式错误时返回false
+// 子网在每个字节上也恰好是[start[i], end[i]]，按字节建树时可直接作为超矩形
+template <typename Bytes, typename Parser>
+inline bool cidrRange(const std::string& cidr, Parser parse, Bytes& start, Bytes& end) {
+    size_t slash = cidr.find('/');
+    if (slash == std::string::npos || slash + 1 == cidr.size() || cidr.size() - slash > 4) return false;
+
+    Bytes base;
+    if (!parse(cidr.data(), cidr.data() + slash, base)) return false;
+    int prefix = 0;
+    for (size_t i = slash + 1; i < cidr.size(); ++i) {
+        if (static_cast<unsigned>(cidr[i] - '0') >= 10) return false;
+        prefix = prefix * 10 + (cidr[i] - '0');
+    }
+    if (prefix > (int)base.size() * 8) return false;
+
+    for (size_t i = 0; i < base.size(); ++i) {
+        int bitOffset = i * 8;
+        if (prefix >= bitOffset + 8) {
+            start[i] = end[i] = base[i];
+        } else if (prefix <= bitOffset) {
+            start[i] = 0; end[i] = 255;
+        } else {
+            int bits = prefix - bitOffset;
+            uint8_t mask = 0xFF << (8 - bits);
+            start[i] = base[i] & mask;
+            end[i] = base[i] | (~mask & 0xFF);
+        }
+    }
+    return true;
+}
+
+// 格式化为点分十进制文本，buf至少16字节，返回写入的长度
+inline int formatIPv4(const IPv4Bytes& ip, char* buf) {
+    return sprintf(buf, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+// 格式化为不省略的8组十六进制文本，buf至少40字节，返回写入的长度
+inline int formatIPv6(const IPv6Bytes& ip, char* buf) {
+    int pos = 0;
+    for (int i = 0; i < 16; i += 2) {
+        pos += sprintf(buf + pos, "%02x%02x%s", ip[i], ip[i+1], (i == 14 ? "" : ":"));
+    }
+    return pos;
+}
+
+// 按IP版本汇总字节形式的解析和格式化
+struct IPv4Family {
+    static constexpr int version = 4;
+    using Bytes = IPv4Bytes;
+    static bool parseText(const char* first, const char* last, Bytes& out) { return parseIPv4(first, last, out); }
+    static int format(const Bytes& ip, char* buf) { return formatIPv4(ip, buf); }
+};
+
+struct IPv6Family {
+    static constexpr int version = 6;
+    using Bytes = IPv6Bytes;
+    static bool parseText(const char* first, const char* last, Bytes& out) { return parseIPv6(first, last, out); }
+    static int format(const Bytes& ip, char* buf) { return formatIPv6(ip, buf); }
+};
+
+// 地址在树中的表示，Codec决定坐标类型Coord和维数K：
+//   ByteCodec：每字节一维，IPv4为4个uint8，IPv6为16个uint8
+//   PackedCodec：按大端打包为整数，IPv4为1个uint32，IPv6为高低2个uint64
+// 子网在打包后的每一维上同样是连续区间，两种表示都能把CIDR查询精确地转换为超矩形
+// 公共操作由CodecOps根据fromBytes/toBytes实现
+template <typename Family, typename Derived>
+struct CodecOps : Family {
+    using Bytes = typename Family::Bytes;
+
+    template <typename Point>
+    static bool parse(const char* first, const char* last, Point& out) {
+        Bytes b;
+        if (!Family::parseText(first, last, b)) return false;
+        out = Derived::fromBytes(b);
+        return true;
+    }
+
+    template <typename Point>
+    static bool cidrToBox(const std::string& cidr, Point& low, Point& high) {
+        Bytes start, end;
+        if (!cidrRange(cidr, &Family::parseText, start, end)) return false;
+        low = Derived::fromBytes(start);
+        high = Derived::fromBytes(end);
+        return true;
+    }
+
+    template <typename Point>
+    static int format(const Point& ip, char* buf) { return Family::format(Derived::toBytes(ip), buf); }
+};
+
+template <typename Family>
+struct ByteCodec : CodecOps<Family, ByteCodec<Family>> {
+    using Coord = uint8_t;
+    static constexpr size_t K = sizeof(typename Family::Bytes);
+    using Point = std::array<Coord, K>;
+
+    static Point fromBytes(const typename Family::Bytes& b) { return b; }
+    static typename Family::Bytes toBytes(const Point& p) { return p; }
+};
+
+template <typename Family, typename CoordType>
+struct PackedCodec : CodecOps<Family, PackedCodec<Family, CoordType>> {
+    using Coord = CoordType;
+    static constexpr size_t K = sizeof(typename Family::Bytes) / sizeof(Coord);
+    using Point = std::array<Coord, K>;
+
+    static Point fromBytes(const typename Family::Bytes& b) {
+        Point p;
+        for (size_t d = 0; d < K; ++d) {
+            Coord v = 0;
+            for (size_t i = 0; i < sizeof(Coord); ++i) v = (v << 8) | b[d * sizeof(Coord) + i];
+            p[d] = v;
+        }
+        return p;
+    }
+    static typename Family::Bytes toBytes(const Point& p) {
+        typename Family::Bytes b;
+        for (size_t d = 0; d < K; ++d) {
+            for (size_t i = 0; i < sizeof(Coord); ++i) {
+                b[d * sizeof(Coord) + i] = static_cast<uint8_t>(p[d] >> (8 * (sizeof(Coord) - 1 - i)));
+            }
+        }
+        return b;
+    }
+};
+
+using IPv4ByteCodec = ByteCodec<IPv4Family>;
+using IPv6ByteCodec = ByteCodec<IPv6Family>;
+using IPv4PackedCodec = PackedCodec<IPv4Family, uint32_t>;
+using IPv6PackedCodec = PackedCodec<IPv6Family, uint64_t>;
+
+// 解析内存中每行一个地址的文本，空行忽略，行尾的\r忽略，无法解析的行计入skipped
+// 按行边界切成若干块由多个线程并行解析，结果按原来的行序拼接，与线程数无关
+template <typename Codec>
+std::vector<typename Codec::Point> parseIPList(const char* begin, const char* end, unsigned threads, size_t* skipped = nullptr) {
+    using Point = typename Codec::Point;
+    threads = resolveThreads(threads);
+    size_t length = end - begin;
+    size_t chunks = length < (size_t(1) << 20) ? 1 : threads * 4;
+
+    // 块边界对齐到下一行的行首
+    std::vector<const char*> bounds(chunks + 1);
+    bounds[0] = begin;
+    bounds[chunks] = end;
+    for (size_t c = 1; c < chunks; ++c) {
+        const char* p = begin + length / chunks * c;
+        const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        bounds[c] = nl ? std::max(nl + 1, bounds[c - 1]) : end;
+    }
+
+    std::vector<std::vector<Point>> parts(chunks);
+    std::vector<size_t> bad(chunks, 0);
+    parallelFor(chunks, threads, [&](size_t c) {
+        const char* p = bounds[c];
+        const char* chunkEnd = bounds[c + 1];
+        parts[c].reserve((chunkEnd - p) / (Codec::version == 4 ? 12 : 32) + 1);
+        while (p < chunkEnd) {
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', chunkEnd - p));
+            const char* lineEnd = nl ? nl : chunkEnd;
+            const char* last = (lineEnd > p && lineEnd[-1] == '\r') ? lineEnd - 1 : lineEnd;
+            if (last > p) {
+                Point point;
+                if (Codec::parse(p, last, point)) parts[c].push_back(point);
+                else ++bad[c];
+            }
+            p = lineEnd + 1;
+        }
+    });
+
+    std::vector<size_t> offsets(chunks + 1, 0);
+    for (size_t c = 0; c < chunks; ++c) offsets[c + 1] = offsets[c] + parts[c].size();
+    std::vector<Point> result(offsets[chunks]);
+    parallelFor(chunks, threads, [&](size_t c) {
+        std::copy(parts[c].begin(), parts[c].end(), result.begin() + offsets[c]);
+        std::vector<Point>().swap(parts[c]);
+    });
+
+    if (skipped) {
+        *skipped = 0;
+        for (size_t b : bad) *skipped += b;
+    }
+    return result;
+}
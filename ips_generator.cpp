@@ -1,103 +1,371 @@
-#include <iostream>
-#include <cstdio>
-#include <string>
-#include <random>
-#include <vector>
-
-const char HEX_CHARS[] = "0123456789abcdef";
-
-void writeIPv4(FILE* fp, uint32_t ip) {
-    char buf[16];
-    int len = sprintf(buf, "%u.%u.%u.%u\n",
-                      (ip >> 24) & 0xFF,
-                      (ip >> 16) & 0xFF,
-                      (ip >> 8) & 0xFF,
-                      ip & 0xFF);
-    fwrite(buf, 1, len, fp);
-}
-
-void writeIPv6(FILE* fp, std::mt19937& gen) {
-    char buf[40];
-    // 每次生成32位随机数，提供给2个IPv6段
-    std::uniform_int_distribution<uint32_t> dis(0, 0xFFFFFFFF);
-    
-    for (int i = 0; i < 8; ++i) {
-        static uint32_t randVal;
-        if (i % 2 == 0) randVal = dis(gen); // 只在偶数次调用
-        else randVal >>= 16;
-
-        uint16_t section = static_cast<uint16_t>(randVal & 0xFFFF);
-        
-        // 字符映射
-        int base = i * 5;
-        buf[base]     = HEX_CHARS[(section >> 12) & 0xF];
-        buf[base + 1] = HEX_CHARS[(section >> 8) & 0xF];
-        buf[base + 2] = HEX_CHARS[(section >> 4) & 0xF];
-        buf[base + 3] = HEX_CHARS[section & 0xF];
-        
-        if (i < 7) buf[base + 4] = ':';
-    }
-
-    buf[39] = '\n';
-    fwrite(buf, 1, 40, fp);
-}
-
-void generate_ips(int version, long long count) {
-    const char* output_file = "./ips.txt";
-    std::cout << "Generating " << count << " IPv" << version << " addresses to " << output_file << "..." << std::endl;
-
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<uint32_t> disV4(0, 0xFFFFFFFF);
-
-    FILE* fp = fopen(output_file, "w");
-    if (!fp) {
-        std::cerr << "Error: Could not open " << output_file << " for writing." << std::endl;
-        return;
-    }
-
-    // 设置一个较大的系统级缓冲区
-    char setbuf_buffer[65536];
-    setvbuf(fp, setbuf_buffer, _IOFBF, sizeof(setbuf_buffer));
-
-    // 首行写入版本号
-    fprintf(fp, "%d\n", version);
-
-    for (long long i = 0; i < count; ++i) {
-        if (version == 4) {
-            writeIPv4(fp, disV4(gen));
-        } else {
-            writeIPv6(fp, gen);
-        }
-
-        if ((i + 1) % 100000 == 0 || i == count - 1) {
-            std::cout << "\rProgress: " << (i + 1) << "/" << count << std::flush;
-        }
-    }
-
-    fclose(fp);
-    std::cout << "\nFinished." << std::endl;
-}
-
-int main(int argc, char* argv[]) {
-    int version = 4;
-    long long count = 100000;
-
-    for (int i = 1; i < argc; ++i) {
-        std::string arg = argv[i];
-        if (arg == "-v" && i + 1 < argc) {
-            version = std::stoi(argv[++i]);
-        } else if (arg == "-n" && i + 1 < argc) {
-            count = std::stoll(argv[++i]);
-        }
-    }
-
-    if (version != 4 && version != 6) {
-        std::cerr << "Unsupported version: " << version << ". Defaulting to 4." << std::endl;
-        version = 4;
-    }
-
-    generate_ips(version, count);
-
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <random>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "ip_binary.hpp"
+#include "parallel.hpp"
+
+// 输出格式：文本每行一个地址；raw为二进制原始记录；delta为排序后差分变长编码的二进制
+enum class OutputFormat { Text, Raw, Delta };
+
+// 地址分布：uniform在整个地址空间上均匀随机；cluster在若干前缀长度随机的子网中均匀选取，各子网密度不同；
+// zipf按Zipf分布选取子网，排名靠前的少数子网集中了大部分地址
+enum class Distribution { Uniform, Cluster, Zipf };
+
+// 命令行参数
+struct GenOptions {
+    int version = 4;
+    long long count = 100000;
+    OutputFormat format = OutputFormat::Text;
+    std::string outputFile;
+    unsigned threads = 0;        // 生成和排序的线程数，0表示使用全部硬件线程
+    uint64_t seed = 0;           // 随机数种子，相同种子生成的文件相同，与线程数无关
+    bool fixedSeed = false;      // 是否指定了种子，否则取自std::random_device
+    Distribution distribution = Distribution::Uniform;
+    size_t subnets = 1000;       // cluster / zipf的子网个数
+    double zipfExponent = 1.0;   // zipf中第r个子网的权重为1/r^s
+    double duplicateRate = 0.0;  // 每个地址重复此前某个地址的概率
+};
+
+// 地址按CHUNK个一块生成，每块使用独立的随机数流，块的划分与线程数无关
+const size_t CHUNK = size_t(1) << 16;
+
+// xoshiro256**：每次生成64位，状态只有32字节，比mt19937快得多
+class Xoshiro256 {
+public:
+    using result_type = uint64_t;
+
+    // 用splitmix64把种子和流编号展开为初始状态，不同的流互不相关
+    Xoshiro256(uint64_t seed, uint64_t stream) {
+        uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+        for (auto& w : s) w = splitmix64(x);
+    }
+
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return ~uint64_t(0); }
+
+    uint64_t operator()() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // [0, 1)上均匀的double
+    double uniform() { return static_cast<double>((*this)() >> 11) * 0x1.0p-53; }
+    // [0, n)上均匀的整数，取乘积的高64位代替取模
+    uint64_t below(uint64_t n) { return static_cast<uint64_t>((static_cast<unsigned __int128>((*this)()) * n) >> 64); }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+    static uint64_t splitmix64(uint64_t& x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t s[4];
+};
+
+// 按分布生成单个地址，地址为N字节的大端序字节数组
+// 子网表在构造时由种子确定，之后只读，各线程共享
+template <size_t N>
+class AddressSource {
+public:
+    using Bytes = std::array<uint8_t, N>;
+
+    explicit AddressSource(const GenOptions& opts) {
+        if (opts.distribution == Distribution::Uniform || opts.subnets == 0) return;
+        // cluster的前缀长度在[MIN, MAX]中随机，zipf固定为ZIPF_PREFIX
+        const int minPrefix = N == 4 ? 16 : 32;
+        const int maxPrefix = N == 4 ? 24 : 64;
+        const int zipfPrefix = N == 4 ? 16 : 48;
+        Xoshiro256 rng(opts.seed, 0);
+        subnets.resize(opts.subnets);
+        for (Subnet& net : subnets) {
+            randomBytes(rng, net.base);
+            net.prefix = opts.distribution == Distribution::Zipf
+                ? zipfPrefix : minPrefix + static_cast<int>(rng.below(maxPrefix - minPrefix + 1));
+        }
+        if (opts.distribution == Distribution::Zipf) {
+            double total = 0;
+            cdf.resize(subnets.size());
+            for (size_t r = 0; r < subnets.size(); ++r) {
+                total += 1.0 / std::pow(static_cast<double>(r + 1), opts.zipfExponent);
+                cdf[r] = total;
+            }
+        }
+    }
+
+    void next(Xoshiro256& rng, Bytes& ip) const {
+        randomBytes(rng, ip);
+        if (subnets.empty()) return;
+        size_t k = cdf.empty() ? rng.below(subnets.size())
+                               : std::upper_bound(cdf.begin(), cdf.end(), rng.uniform() * cdf.back()) - cdf.begin();
+        // 前缀取子网的，其余位保持随机
+        const Subnet& net = subnets[k];
+        size_t full = net.prefix / 8;
+        std::copy(net.base.begin(), net.base.begin() + full, ip.begin());
+        if (net.prefix % 8 != 0) {
+            uint8_t mask = static_cast<uint8_t>(0xFF << (8 - net.prefix % 8));
+            ip[full] = (net.base[full] & mask) | (ip[full] & ~mask);
+        }
+    }
+
+    static void randomBytes(Xoshiro256& rng, Bytes& ip) {
+        for (size_t i = 0; i < N; i += 8) {
+            uint64_t r = rng();
+            std::memcpy(ip.data() + i, &r, std::min<size_t>(8, N - i));
+        }
+    }
+
+private:
+    struct Subnet {
+        Bytes base;
+        int prefix;
+    };
+    std::vector<Subnet> subnets;
+    std::vector<double> cdf;  // zipf的累积权重，为空时均匀选取子网
+};
+
+// 生成第chunk块的n个地址
+// 按重复率复制本块中已生成的某个地址，块之间互不依赖，可以并行生成
+template <size_t N>
+void generateChunk(const AddressSource<N>& source, const GenOptions& opts, size_t chunk,
+                   std::array<uint8_t, N>* out, size_t n) {
+    Xoshiro256 rng(opts.seed, chunk + 1);
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0 && opts.duplicateRate > 0 && rng.uniform() < opts.duplicateRate) {
+            out[i] = out[rng.below(i)];
+        } else {
+            source.next(rng, out[i]);
+        }
+    }
+}
+
+// 0~255的十进制文本，每项固定4字节，格式化时整项复制再按实际长度前进
+struct DecimalText {
+    char text[256][4];
+    uint8_t len[256];
+    constexpr DecimalText() : text(), len() {
+        for (int i = 0; i < 256; ++i) {
+            int n = 0;
+            if (i >= 100) text[i][n++] = static_cast<char>('0' + i / 100);
+            if (i >= 10) text[i][n++] = static_cast<char>('0' + i / 10 % 10);
+            text[i][n++] = static_cast<char>('0' + i % 10);
+            len[i] = static_cast<uint8_t>(n);
+        }
+    }
+};
+static constexpr DecimalText DECIMAL_TEXT;
+
+// 每个字节对应的两位十六进制文本
+struct HexText {
+    char text[256][2];
+    constexpr HexText() : text() {
+        const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 256; ++i) {
+            text[i][0] = digits[i >> 4];
+            text[i][1] = digits[i & 0xF];
+        }
+    }
+};
+static constexpr HexText HEX_TEXT;
+
+// 每行文本的最大长度，格式化IPv4时最后一次复制会多写3字节，缓冲区按此留出余量
+template <size_t N>
+constexpr size_t maxLine() { return N == 4 ? 16 + 3 : 40; }
+
+// 把一个地址格式化为一行文本，返回写入的字节数
+inline size_t formatLine(const std::array<uint8_t, 4>& ip, char* out) {
+    char* p = out;
+    for (int i = 0; i < 4; ++i) {
+        std::memcpy(p, DECIMAL_TEXT.text[ip[i]], 4);
+        p += DECIMAL_TEXT.len[ip[i]];
+        *p++ = i < 3 ? '.' : '\n';
+    }
+    return p - out;
+}
+
+// IPv6按8段完整的4位十六进制输出，不做零压缩
+inline size_t formatLine(const std::array<uint8_t, 16>& ip, char* out) {
+    for (int i = 0; i < 8; ++i) {
+        std::memcpy(out + 5 * i, HEX_TEXT.text[ip[2 * i]], 2);
+        std::memcpy(out + 5 * i + 2, HEX_TEXT.text[ip[2 * i + 1]], 2);
+        out[5 * i + 4] = ':';
+    }
+    out[39] = '\n';
+    return 40;
+}
+
+// 把一块地址编码为文本或raw记录，追加到buf
+template <size_t N>
+void encodeChunk(const std::vector<std::array<uint8_t, N>>& ips, size_t n, bool text, std::vector<char>& buf) {
+    if (!text) {
+        buf.resize(n * N);
+        std::memcpy(buf.data(), ips.data(), n * N);
+        return;
+    }
+    buf.resize(n * maxLine<N>());
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) len += formatLine(ips[i], buf.data() + len);
+    buf.resize(len);
+}
+
+void printProgress(long long done, long long count) {
+    std::cout << "\rProgress: " << done << "/" << count << std::flush;
+}
+
+// text和raw：各线程并行生成并编码若干块，再按块的顺序一次写出
+template <size_t N>
+bool writeStream(FILE* fp, const AddressSource<N>& source, const GenOptions& opts) {
+    size_t count = static_cast<size_t>(opts.count);
+    size_t chunks = (count + CHUNK - 1) / CHUNK;
+    unsigned threads = resolveThreads(opts.threads);
+    size_t window = 2 * threads;
+    bool text = opts.format == OutputFormat::Text;
+
+    std::vector<std::vector<std::array<uint8_t, N>>> ips(window);
+    std::vector<std::vector<char>> buffers(window);
+    for (size_t base = 0; base < chunks; base += window) {
+        size_t n = std::min(window, chunks - base);
+        parallelFor(n, threads, [&](size_t w) {
+            size_t chunk = base + w;
+            size_t len = std::min(CHUNK, count - chunk * CHUNK);
+            ips[w].resize(len);
+            generateChunk(source, opts, chunk, ips[w].data(), len);
+            encodeChunk(ips[w], len, text, buffers[w]);
+        });
+        for (size_t w = 0; w < n; ++w) {
+            if (fwrite(buffers[w].data(), 1, buffers[w].size(), fp) != buffers[w].size()) return false;
+        }
+        printProgress(static_cast<long long>(std::min(count, (base + n) * CHUNK)), opts.count);
+    }
+    return true;
+}
+
+// delta：先并行生成全部地址，排序后顺序做差分编码
+template <size_t N>
+bool writeDelta(FILE* fp, const AddressSource<N>& source, const GenOptions& opts) {
+    size_t count = static_cast<size_t>(opts.count);
+    std::vector<std::array<uint8_t, N>> ips(count);
+    parallelFor((count + CHUNK - 1) / CHUNK, opts.threads, [&](size_t chunk) {
+        generateChunk(source, opts, chunk, ips.data() + chunk * CHUNK, std::min(CHUNK, count - chunk * CHUNK));
+    });
+    parallelSort(ips.begin(), ips.end(), opts.threads);
+
+    DeltaEncoder<N> encoder;
+    std::vector<uint8_t> buf(CHUNK * DeltaEncoder<N>::MAX_BYTES);
+    for (size_t first = 0; first < count; first += CHUNK) {
+        size_t last = std::min(count, first + CHUNK), len = 0;
+        for (size_t i = first; i < last; ++i) len += encoder.encode(ips[i], buf.data() + len);
+        if (fwrite(buf.data(), 1, len, fp) != len) return false;
+        printProgress(static_cast<long long>(last), opts.count);
+    }
+    return true;
+}
+
+template <size_t N>
+bool writeAddresses(FILE* fp, const GenOptions& opts) {
+    AddressSource<N> source(opts);
+    if (opts.format == OutputFormat::Delta) return writeDelta(fp, source, opts);
+    return writeStream(fp, source, opts);
+}
+
+void generate_ips(const GenOptions& opts) {
+    std::cout << "Generating " << opts.count << " IPv" << opts.version << " addresses to " << opts.outputFile
+              << " (seed " << opts.seed << ")..." << std::endl;
+
+    FILE* fp = fopen(opts.outputFile.c_str(), opts.format == OutputFormat::Text ? "w" : "wb");
+    if (!fp) {
+        std::cerr << "Error: Could not open " << opts.outputFile << " for writing." << std::endl;
+        return;
+    }
+
+    // 文本首行写入版本号，二进制写入文件头
+    if (opts.format == OutputFormat::Text) {
+        fprintf(fp, "%d\n", opts.version);
+    } else {
+        IPBinaryHeader header = makeIPBinaryHeader(opts.version, opts.format == OutputFormat::Raw ? IP_RAW : IP_DELTA, opts.count);
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = opts.version == 4 ? writeAddresses<4>(fp, opts) : writeAddresses<16>(fp, opts);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        std::cerr << "\nError: Failed writing " << opts.outputFile << std::endl;
+        return;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "\nFinished in " << seconds << " s, " << (seconds > 0 ? opts.count / seconds : 0) << " addresses/s" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    GenOptions opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-v" && i + 1 < argc) {
+            opts.version = std::stoi(argv[++i]);
+        } else if (arg == "-n" && i + 1 < argc) {
+            opts.count = std::stoll(argv[++i]);
+        } else if (arg == "-f" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "raw") opts.format = OutputFormat::Raw;
+            else if (name == "delta") opts.format = OutputFormat::Delta;
+            else if (name == "text") opts.format = OutputFormat::Text;
+            else std::cerr << "Unsupported format: " << name << ". Defaulting to text." << std::endl;
+        } else if (arg == "-o" && i + 1 < argc) {
+            opts.outputFile = argv[++i];
+        } else if (arg == "-t" && i + 1 < argc) {
+            opts.threads = std::stoul(argv[++i]);
+        } else if (arg == "-s" && i + 1 < argc) {
+            opts.seed = std::stoull(argv[++i]);
+            opts.fixedSeed = true;
+        } else if (arg == "-d" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "cluster") opts.distribution = Distribution::Cluster;
+            else if (name == "zipf") opts.distribution = Distribution::Zipf;
+            else if (name == "uniform") opts.distribution = Distribution::Uniform;
+            else std::cerr << "Unsupported distribution: " << name << ". Defaulting to uniform." << std::endl;
+        } else if (arg == "-c" && i + 1 < argc) {
+            opts.subnets = std::stoull(argv[++i]);
+        } else if (arg == "-z" && i + 1 < argc) {
+            opts.zipfExponent = std::stod(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            opts.duplicateRate = std::stod(argv[++i]);
+        }
+    }
+
+    if (opts.version != 4 && opts.version != 6) {
+        std::cerr << "Unsupported version: " << opts.version << ". Defaulting to 4." << std::endl;
+        opts.version = 4;
+    }
+    if (opts.count < 0) opts.count = 0;
+    opts.duplicateRate = std::min(std::max(opts.duplicateRate, 0.0), 1.0);
+    if (opts.outputFile.empty()) {
+        opts.outputFile = opts.format == OutputFormat::Text ? "./ips.txt" : "./ips.bin";
+    }
+    // 未指定种子时随机选取，并在输出中打印，便于复现
+    if (!opts.fixedSeed) {
+        std::random_device rd;
+        opts.seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+
+    generate_ips(opts);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "ip_server.hpp"
+
+// ips_query服务模式的压测客户端：多个连接并发发送CIDR请求，每个连接保持若干个未完成的请求，
+// 统计吞吐量和每个请求从发出到收齐回复的延迟
+
+// 命令行参数
+struct LoadOptions {
+    std::string address;        // 服务地址，格式与ips_query -l相同
+    std::string cidrFile;       // CIDR列表文件，请求依次循环使用其中的子网
+    size_t requests = 0;        // 总请求数，0表示列表中的每个子网各请求一次
+    size_t pipeline = 16;       // 每个连接上未完成的请求数上限
+    unsigned connections = 4;   // 并发连接数，每个连接一个线程
+    bool countOnly = false;     // 只请求命中数
+};
+
+// 单个连接的统计
+struct ConnectionResult {
+    std::vector<double> latencies;  // 每个请求的延迟，微秒
+    uint64_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t invalid = 0;
+    bool failed = false;
+};
+
+#ifdef __linux__
+
+// 在一个连接上发送quota个请求，从列表的第first个子网开始
+void runConnection(const SocketAddress& addr, const LoadOptions& opts, const std::vector<std::string>& cidrs,
+                   size_t first, size_t quota, ConnectionResult& result) {
+    int fd = connectSocket(addr);
+    if (fd < 0) {
+        result.failed = true;
+        return;
+    }
+    result.latencies.reserve(quota);
+
+    std::deque<std::chrono::steady_clock::time_point> sentAt;
+    std::string out, line;
+    std::vector<char> buf(size_t(1) << 16);
+    size_t sent = 0;
+    const char* prefix = opts.countOnly ? "count " : "";
+
+    while (result.latencies.size() < quota) {
+        // 补足流水线中的请求，一次写出
+        out.clear();
+        while (sentAt.size() < opts.pipeline && sent < quota) {
+            out.append(prefix).append(cidrs[(first + sent) % cidrs.size()]).push_back('\n');
+            sentAt.push_back(std::chrono::steady_clock::now());
+            ++sent;
+        }
+        for (size_t pos = 0; pos < out.size();) {
+            ssize_t n = send(fd, out.data() + pos, out.size() - pos, MSG_NOSIGNAL);
+            if (n <= 0) {
+                result.failed = true;
+                close(fd);
+                return;
+            }
+            pos += n;
+        }
+
+        ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+        if (n <= 0) {
+            result.failed = true;
+            break;
+        }
+        result.bytes += n;
+
+        // 回复为命中的IP各一行，最后一行为"<CIDR> <命中数>"或"<CIDR> invalid"；IP行不含空格
+        const char* p = buf.data();
+        const char* end = p + n;
+        while (p < end) {
+            const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            if (!newline) {
+                line.append(p, end);
+                break;
+            }
+            line.append(p, newline);
+            p = newline + 1;
+            size_t space = line.rfind(' ');
+            if (space == std::string::npos) {
+                line.clear();
+                continue;
+            }
+            std::string value = line.substr(space + 1);
+            line.clear();
+            if (value == "invalid") ++result.invalid;
+            else result.hits += std::strtoull(value.c_str(), nullptr, 10);
+            auto now = std::chrono::steady_clock::now();
+            result.latencies.push_back(std::chrono::duration<double, std::micro>(now - sentAt.front()).count());
+            sentAt.pop_front();
+        }
+    }
+    close(fd);
+}
+
+// 已排序的延迟中第q分位的值
+double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * (sorted.size() - 1) + 0.5))];
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-l" && i + 1 < argc) {
+            opts.address = argv[++i];
+        } else if (arg == "-b" && i + 1 < argc) {
+            opts.cidrFile = argv[++i];
+        } else if (arg == "-n" && i + 1 < argc) {
+            opts.requests = static_cast<size_t>(std::stod(argv[++i]));
+        } else if (arg == "-p" && i + 1 < argc) {
+            opts.pipeline = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "-t" && i + 1 < argc) {
+            opts.connections = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "-c") {
+            opts.countOnly = true;
+        }
+    }
+
+    SocketAddress addr;
+    if (opts.address.empty() || !parseSocketAddress(opts.address, addr)) {
+        std::cerr << "Error: Missing or invalid server address, use -l unix:<path> or -l [<host>:]<port>" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> cidrs;
+    std::ifstream in(opts.cidrFile);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) cidrs.push_back(line);
+    }
+    if (cidrs.empty()) {
+        std::cerr << "Error: No CIDR found in " << (opts.cidrFile.empty() ? "(missing -b)" : opts.cidrFile) << std::endl;
+        return 1;
+    }
+    if (opts.requests == 0) opts.requests = cidrs.size();
+
+    // 请求平均分给各连接，各连接依次接着上一个连接的位置取子网，总请求数等于列表长度时每个子网恰好请求一次
+    std::vector<ConnectionResult> results(opts.connections);
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    size_t first = 0;
+    for (unsigned c = 0; c < opts.connections; ++c) {
+        size_t quota = opts.requests / opts.connections + (c < opts.requests % opts.connections ? 1 : 0);
+        pool.emplace_back([&, c, quota, first] { runConnection(addr, opts, cidrs, first, quota, results[c]); });
+        first += quota;
+    }
+    for (auto& th : pool) th.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> latencies;
+    uint64_t bytes = 0, hits = 0, invalid = 0;
+    unsigned failed = 0;
+    for (const auto& r : results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+        bytes += r.bytes;
+        hits += r.hits;
+        invalid += r.invalid;
+        failed += r.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << latencies.size() << "/" << opts.requests << " request(s) on " << opts.connections
+              << " connection(s), pipeline depth " << opts.pipeline << std::endl;
+    std::cout << "Elapsed " << seconds << " s, " << (seconds > 0 ? latencies.size() / seconds : 0) << " requests/s, "
+              << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s" << std::endl;
+    std::cout << "Latency (us): p50 " << percentile(latencies, 0.5) << ", p90 " << percentile(latencies, 0.9)
+              << ", p99 " << percentile(latencies, 0.99) << ", max " << (latencies.empty() ? 0 : latencies.back()) << std::endl;
+    std::cout << hits << " IP(s) found, " << invalid << " invalid CIDR(s)" << std::endl;
+    if (failed > 0) {
+        std::cerr << "Error: " << failed << " connection(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+int main() {
+    std::cerr << "Error: ips_load is only supported on Linux" << std::endl;
+    return 1;
+}
+
+#endif
@@ -1,198 +1,640 @@
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <vector>
-#include <array>
-#include <sstream>
-#include <cstdint>
-#include <iomanip>
-#include <algorithm>
-#include "kd_tree.hpp"
-
-// IPv4解析
-std::array<int, 4> parseIPv4(const std::string& ipStr) {
-    std::array<int, 4> addr = {0};
-    std::stringstream ss(ipStr);
-    std::string item;
-    int i = 0;
-    while (std::getline(ss, item, '.') && i < 4) {
-        addr[i++] = std::stoi(item);
-    }
-    return addr;
-}
-
-// IPv6解析，支持::连写的形式
-std::array<int, 16> parseIPv6(const std::string& ipStr) {
-    std::array<int, 16> addr = {0};
-    std::vector<std::string> parts;
-    std::string s = ipStr;
-    size_t doubleColonPos = s.find("::");
-
-    auto parseHexPart = [](const std::string& section, std::vector<uint8_t>& out) {
-        std::stringstream ss(section);
-        std::string item;
-        while (std::getline(ss, item, ':')) {
-            if (item.empty()) continue;
-            uint32_t val = std::stoul(item, nullptr, 16);
-            out.push_back((val >> 8) & 0xFF);
-            out.push_back(val & 0xFF);
-        }
-    };
-
-    if (doubleColonPos != std::string::npos) {
-        std::vector<uint8_t> left, right;
-        parseHexPart(s.substr(0, doubleColonPos), left);
-        parseHexPart(s.substr(doubleColonPos + 2), right);
-        
-        int middleZeros = 16 - left.size() - right.size();
-        int idx = 0;
-        for (auto b : left) addr[idx++] = b;
-        for (int i = 0; i < middleZeros; ++i) addr[idx++] = 0;
-        for (auto b : right) addr[idx++] = b;
-    } else {
-        std::vector<uint8_t> all;
-        parseHexPart(s, all);
-        for (int i = 0; i < 16 && i < (int)all.size(); ++i) addr[i] = all[i];
-    }
-    return addr;
-}
-
-// IPv4模式
-void runIPv4(std::ifstream& inFile) {
-    KDTree<int, 4> ipTree;
-    std::vector<std::array<int, 4>> ipv4s;
-
-    std::string line;
-    while (std::getline(inFile, line)) {
-        if (!line.empty()) ipv4s.push_back(parseIPv4(line));
-    }
-    inFile.close();
-    ipTree.build(ipv4s);
-
-    std::string input;
-    while (true) {
-        std::cout << "IPv4 Subnet (CIDR) or q: ";
-        std::cin >> input;
-        if (input == "q") break;
-
-        size_t slash = input.find('/');
-        if (slash == std::string::npos) continue;
-
-        std::array<int, 4> base = parseIPv4(input.substr(0, slash));
-        int prefix = std::stoi(input.substr(slash + 1));
-
-        uint32_t ipUint = 0;
-        for (int i = 0; i < 4; ++i) ipUint = (ipUint << 8) | (uint8_t)base[i];
-
-        uint32_t mask = (prefix == 0) ? 0 : (0xFFFFFFFF << (32 - prefix));
-        uint32_t start = ipUint & mask;
-        uint32_t end = start | (~mask);
-
-        std::array<int, 4> low, high;
-        for (int i = 0; i < 4; ++i) {
-            low[i] = (start >> (24 - i * 8)) & 0xFF;
-            high[i] = (end >> (24 - i * 8)) & 0xFF;
-        }
-
-        auto results = ipTree.rangeSearch(low, high);
-        
-        // 结果写入到文件
-        std::ofstream outFile("ips_query_result.txt", std::ios::trunc);
-        if (outFile.is_open()) {
-            for (const auto& ip : results) {
-                char buf[64];
-                sprintf(buf, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-                outFile << buf << "\n";
-            }
-            outFile.close();
-        }
-
-        std::cout << results.size() << " IP(s) found and saved to ips_query_result.txt\n" << std::endl;
-    }
-}
-
-// IPv6模式
-void runIPv6(std::ifstream& inFile) {
-    KDTree<int, 16> ipTree;
-    std::vector<std::array<int, 16>> ipv6s;
-
-    std::string line;
-    while (std::getline(inFile, line)) {
-        if (!line.empty()) ipv6s.push_back(parseIPv6(line));
-    }
-    inFile.close();
-    ipTree.build(ipv6s);
-    
-    std::string input;
-    while (true) {
-        std::cout << "IPv6 Subnet (CIDR) or q: ";
-        std::cin >> input;
-        if (input == "q") break;
-
-        size_t slash = input.find('/');
-        if (slash == std::string::npos) continue;
-
-        std::array<int, 16> base = parseIPv6(input.substr(0, slash));
-        int prefix = std::stoi(input.substr(slash + 1));
-
-        std::array<int, 16> low, high;
-        for (int i = 0; i < 16; ++i) {
-            int bitOffset = i * 8;
-            if (prefix >= bitOffset + 8) {
-                low[i] = high[i] = base[i];
-            } else if (prefix <= bitOffset) {
-                low[i] = 0; high[i] = 255;
-            } else {
-                int bits = prefix - bitOffset;
-                uint8_t mask = 0xFF << (8 - bits);
-                low[i] = base[i] & mask;
-                high[i] = base[i] | (~mask & 0xFF);
-            }
-        }
-
-        auto results = ipTree.rangeSearch(low, high);
-
-        // 结果写入到文件
-        std::ofstream outFile("ips_query_result.txt", std::ios::trunc);
-        if (outFile.is_open()) {
-            for (const auto& ip : results) {
-                char buf[128];
-                int pos = 0;
-                for (int i = 0; i < 16; i += 2) {
-                    pos += sprintf(buf + pos, "%02x%02x%c", ip[i], ip[i+1], (i == 14 ? '\0' : ':'));
-                }
-                outFile << buf << "\n";
-            }
-            outFile.close();
-        }
-
-        std::cout << results.size() << " IP(s) found and saved to ips_query_result.txt\n" << std::endl;
-    }
-}
-
-
-int main() {
-    std::ifstream inFile("ips.txt");
-    if (!inFile) {
-        std::cerr << "Error: Cannot open ips.txt" << std::endl;
-        return 1;
-    }
-
-    // 读取首行，代表的是ips.txt中的IP版本
-    std::string firstLine;
-    if (!std::getline(inFile, firstLine)) return 1;
-
-    int version = std::stoi(firstLine);
-    if (version == 4) {
-        std::cout << "Detected IPv4 mode. Loading searching tree may take a while..." << std::endl;
-        runIPv4(inFile);
-    } else if (version == 6) {
-        std::cout << "Detected IPv6 mode. Loading searching tree may take a while..." << std::endl;
-        runIPv6(inFile);
-    } else {
-        std::cerr << "Unsupported version in first line: " << version << std::endl;
-        return 1;
-    }
-
-    return 0;
-}
\ No newline at end of file
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <utility>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <limits>
+#include <stdexcept>
+#include <mutex>
+#include "static_kd_tree.hpp"
+#include "ip_sorted_index.hpp"
+#include "parallel.hpp"
+#include "ip_utils.hpp"
+#include "mapped_file.hpp"
+#include "ip_binary.hpp"
+#include "ip_server.hpp"
+#include "external_kd_tree.hpp"
+
+// 命令行参数
+struct QueryOptions {
+    unsigned threads = 0;       // 建树和批量查询的线程数，0表示使用全部硬件线程
+    std::string batchFile;      // 批量查询的CIDR列表文件，为空时进入交互模式
+    bool groupQueries = false;  // 批量查询时按子网排序后执行，相邻查询复用缓存中的子树
+    bool countOnly = false;     // 批量查询时只输出每个子网的命中数
+    bool packedKeys = true;     // 地址打包为整数建树，否则每字节一维
+    std::string snapshotOut;    // 建树后把树保存为快照文件
+    std::string snapshotIn;     // 直接从快照文件启动，不读取ips.txt
+    std::string inputFile = "ips.txt";  // 地址列表文件，文本或二进制格式
+    bool binaryOutput = false;  // 查询结果写成二进制格式
+    bool sortedIndex = false;   // 使用排序数组索引代替KDTree
+    bool externalIndex = false; // 使用外存KDTree，索引文件由-w指定
+    size_t memoryMB = 256;      // 外存KDTree建树和查询的内存上限
+    std::string statsFile;      // 查询统计的输出文件，为空时不统计
+    std::string listenAddress;  // 服务模式的监听地址，为空时为交互或批量模式
+};
+
+// 查询结果文件名，按输出格式区分
+inline const char* resultFile(const QueryOptions& opts) {
+    return opts.binaryOutput ? "ips_query_result.bin" : "ips_query_result.txt";
+}
+
+// 把一个命中地址追加到结果缓冲区，文本为一行，二进制为一条原始记录
+template <typename Codec>
+inline void appendResult(std::string& out, const typename Codec::Point& ip, bool binary) {
+    if (binary) {
+        typename Codec::Bytes b = Codec::toBytes(ip);
+        out.append(reinterpret_cast<const char*>(b.data()), b.size());
+    } else {
+        char buf[64];
+        int len = Codec::format(ip, buf);
+        out.append(buf, len).push_back('\n');
+    }
+}
+
+// 索引是否记录查询统计，只有以KDQueryStats实例化的StaticKDTree支持
+template <typename Index>
+struct IndexStats {
+    static constexpr bool enabled = false;
+};
+template <typename T, size_t K, typename Stats>
+struct IndexStats<StaticKDTree<T, K, Stats>> {
+    static constexpr bool enabled = Stats::enabled;
+};
+
+// 耗时最长的若干次查询，按耗时降序排列
+struct SlowQueries {
+    static constexpr size_t LIMIT = 10;
+    std::vector<std::pair<std::string, KDQueryCounters>> entries;
+
+    void add(const std::string& cidr, const KDQueryCounters& c) {
+        if (entries.size() == LIMIT && entries.back().second.latencyNs >= c.latencyNs) return;
+        auto pos = std::find_if(entries.begin(), entries.end(), [&](const std::pair<std::string, KDQueryCounters>& e) {
+            return e.second.latencyNs < c.latencyNs;
+        });
+        entries.insert(pos, {cidr, c});
+        if (entries.size() > LIMIT) entries.pop_back();
+    }
+};
+
+// 批量查询中的单个子网
+template <typename Codec>
+struct BatchQuery {
+    std::string cidr;
+    typename Codec::Point low, high;
+    bool valid;
+};
+
+// 查询前端只使用索引的rangeVisit/rangeCount，Index为StaticKDTree或SortedIPIndex
+// 交互模式：从std::cin逐个读取子网
+template <typename Codec, typename Index>
+void runInteractive(const Index& ipIndex, const QueryOptions& opts, SlowQueries& slowest) {
+    std::string input;
+    while (true) {
+        std::cout << "IPv" << Codec::version << " Subnet (CIDR) or q: ";
+        std::cin >> input;
+        if (input == "q") break;
+
+        typename Codec::Point low, high;
+        if (!Codec::cidrToBox(input, low, high)) continue;
+
+        // 结果边查找边写入到文件，只缓存最近一段输出，不生成中间数组
+        // 二进制格式先写入count为0的文件头，查询结束后再回填命中数
+        size_t found = 0;
+        std::ofstream outFile(resultFile(opts), std::ios::trunc | std::ios::binary);
+        if (opts.binaryOutput) {
+            IPBinaryHeader header = makeIPBinaryHeader(Codec::version, IP_RAW, 0);
+            outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+        std::string pending;
+        ipIndex.rangeVisit(low, high, [&](const typename Codec::Point& ip) {
+            ++found;
+            if (!outFile.is_open()) return;
+            appendResult<Codec>(pending, ip, opts.binaryOutput);
+            if (pending.size() >= 65536) {
+                outFile.write(pending.data(), pending.size());
+                pending.clear();
+            }
+        });
+        if constexpr (IndexStats<Index>::enabled) slowest.add(input, KDQueryStats::lastQuery());
+        outFile.write(pending.data(), pending.size());
+        if (opts.binaryOutput) {
+            IPBinaryHeader header = makeIPBinaryHeader(Codec::version, IP_RAW, found);
+            outFile.seekp(0).write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+        outFile.close();
+
+        std::cout << found << " IP(s) found and saved to " << resultFile(opts) << "\n" << std::endl;
+    }
+}
+
+// 批量模式：读取整个CIDR列表文件，多线程查询
+// 查询按窗口处理，窗口内的结果先写入各自的缓冲区，再按输入顺序写入文件，输出与线程数无关
+template <typename Codec, typename Index>
+void runBatch(const Index& ipIndex, const QueryOptions& opts, SlowQueries& slowest) {
+    std::ifstream batchIn(opts.batchFile);
+    if (!batchIn) {
+        std::cerr << "Error: Cannot open " << opts.batchFile << std::endl;
+        return;
+    }
+
+    std::vector<BatchQuery<Codec>> queries;
+    std::string line;
+    while (std::getline(batchIn, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        BatchQuery<Codec> q;
+        q.cidr = line;
+        q.valid = Codec::cidrToBox(line, q.low, q.high);
+        queries.push_back(std::move(q));
+    }
+    batchIn.close();
+
+    std::ofstream outFile(resultFile(opts), std::ios::trunc | std::ios::binary);
+    if (!outFile) {
+        std::cerr << "Error: Cannot open " << resultFile(opts) << " for writing" << std::endl;
+        return;
+    }
+    if (opts.binaryOutput) {
+        IPBinaryHeader header = makeIPBinaryHeader(Codec::version, IP_GROUPED, queries.size());
+        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    // 每个窗口内的查询数，以及分给一个线程的连续查询数
+    const size_t window = 65536;
+    const size_t run = 64;
+    size_t totalFound = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t base = 0; base < queries.size(); base += window) {
+        size_t count = std::min(window, queries.size() - base);
+
+        // 执行顺序：分组时按子网下界排序，路径相近的查询由同一线程连续执行
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), base);
+        if (opts.groupQueries) {
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return queries[a].low < queries[b].low;
+            });
+        }
+
+        std::vector<size_t> found(count, 0);
+        std::vector<std::string> output(opts.countOnly ? 0 : count);
+        // 每次查询的计数由执行它的线程取出，窗口结束后再挑出最慢的
+        std::vector<KDQueryCounters> counters(IndexStats<Index>::enabled ? count : 0);
+        parallelFor((count + run - 1) / run, opts.threads, [&](size_t r) {
+            size_t end = std::min(count, (r + 1) * run);
+            for (size_t i = r * run; i < end; ++i) {
+                size_t idx = order[i];
+                const BatchQuery<Codec>& q = queries[idx];
+                if (!q.valid) continue;
+                if (opts.countOnly) {
+                    found[idx - base] = ipIndex.rangeCount(q.low, q.high);
+                } else {
+                    std::string& out = output[idx - base];
+                    ipIndex.rangeVisit(q.low, q.high, [&](const typename Codec::Point& ip) {
+                        appendResult<Codec>(out, ip, opts.binaryOutput);
+                        ++found[idx - base];
+                    });
+                }
+                if constexpr (IndexStats<Index>::enabled) counters[idx - base] = KDQueryStats::lastQuery();
+            }
+        });
+        if constexpr (IndexStats<Index>::enabled) {
+            for (size_t i = 0; i < count; ++i) {
+                if (queries[base + i].valid) slowest.add(queries[base + i].cidr, counters[i]);
+            }
+        }
+
+        // 按输入顺序写出：每个子网一行"<CIDR> <命中数>"，随后是命中的IP
+        // 二进制格式每个子网为8字节命中数和命中地址的原始记录
+        for (size_t i = 0; i < count; ++i) {
+            const BatchQuery<Codec>& q = queries[base + i];
+            if (opts.binaryOutput) {
+                uint64_t hits = q.valid ? found[i] : IP_GROUP_INVALID;
+                outFile.write(reinterpret_cast<const char*>(&hits), sizeof(hits));
+                if (!opts.countOnly) outFile << output[i];
+                totalFound += q.valid ? found[i] : 0;
+                continue;
+            }
+            if (!q.valid) {
+                outFile << q.cidr << " invalid\n";
+                continue;
+            }
+            outFile << q.cidr << " " << found[i] << "\n";
+            if (!opts.countOnly) outFile << output[i];
+            totalFound += found[i];
+        }
+    }
+    outFile.close();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << queries.size() << " queries, " << totalFound << " IP(s) found and saved to " << resultFile(opts) << std::endl;
+    std::cout << "Elapsed " << seconds << " s, " << (seconds > 0 ? queries.size() / seconds : 0) << " queries/s" << std::endl;
+}
+
+// 进入服务、交互或批量模式
+// 服务模式：索引常驻内存，通过套接字接受请求，直到收到SIGINT或SIGTERM
+// 每行一个请求，<CIDR>返回命中的IP，最后一行为"<CIDR> <命中数>"；count <CIDR>只返回命中数行，格式错误时返回"<CIDR> invalid"
+// 命中数行放在结果之后，一次遍历即可边查找边发送，客户端读到含空格的行即为一个回复的结尾
+template <typename Codec, typename Index>
+void runServer(const Index& ipIndex, const QueryOptions& opts, SlowQueries& slowest) {
+#ifdef __linux__
+    SocketAddress addr;
+    if (!parseSocketAddress(opts.listenAddress, addr)) {
+        std::cerr << "Error: Invalid listen address " << opts.listenAddress << std::endl;
+        return;
+    }
+    if (opts.binaryOutput) {
+        std::cerr << "Warning: server replies are always text" << std::endl;
+    }
+
+    std::mutex slowLock;
+    QueryServer server([&](const std::string& request, QueryServer::ReplyStream& out) {
+        bool countOnly = opts.countOnly;
+        std::string cidr = request;
+        if (cidr.compare(0, 6, "count ") == 0) {
+            countOnly = true;
+            cidr.erase(0, 6);
+        }
+        std::string& buf = out.buffer();
+        typename Codec::Point low, high;
+        if (!Codec::cidrToBox(cidr, low, high)) {
+            buf.append(cidr).append(" invalid\n");
+            return;
+        }
+        size_t found = 0;
+        if (countOnly) {
+            found = ipIndex.rangeCount(low, high);
+        } else {
+            // 遍历中途客户端断开时跳过剩余结果的格式化
+            bool open = true;
+            ipIndex.rangeVisit(low, high, [&](const typename Codec::Point& ip) {
+                ++found;
+                if (!open) return;
+                appendResult<Codec>(buf, ip, false);
+                open = out.flush();
+            });
+        }
+        buf.append(cidr).append(" ").append(std::to_string(found)).push_back('\n');
+        // 每个请求只遍历一次，与批量模式相同记一次查询，计数由执行它的线程取出
+        if constexpr (IndexStats<Index>::enabled) {
+            KDQueryCounters counters = KDQueryStats::lastQuery();
+            std::lock_guard<std::mutex> guard(slowLock);
+            slowest.add(cidr, counters);
+        }
+    }, opts.threads);
+
+    if (!server.listen(addr)) {
+        std::cerr << "Error: Cannot listen on " << opts.listenAddress << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    std::cout << "Serving IPv" << Codec::version << " queries on " << opts.listenAddress << ", press Ctrl+C to stop" << std::endl;
+    if (!server.run()) {
+        std::cerr << "Error: Cannot start server on " << opts.listenAddress << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    std::cout << "Served " << server.requestCount() << " request(s) on " << server.connectionCount() << " connection(s)" << std::endl;
+#else
+    (void)ipIndex;
+    (void)slowest;
+    std::cerr << "Error: Server mode is only supported on Linux (" << opts.listenAddress << ")" << std::endl;
+#endif
+}
+
+// 把树的形状、查询统计和最慢的查询写成JSON
+template <typename Codec, typename Index>
+void writeQueryStats(const Index& ipIndex, const SlowQueries& slowest, const QueryOptions& opts) {
+    std::ofstream statsOut(opts.statsFile, std::ios::trunc);
+    if (!statsOut) {
+        std::cerr << "Error: Cannot open " << opts.statsFile << " for writing" << std::endl;
+        return;
+    }
+    statsOut << "{\n  \"index\": \"kd\",\n  \"version\": " << Codec::version << ",\n  \"shape\": " << ipIndex.shape().toJson()
+             << ",\n  \"queries\": " << ipIndex.queryStats().toJson() << ",\n  \"slowest\": [";
+    for (size_t i = 0; i < slowest.entries.size(); ++i) {
+        statsOut << (i ? "," : "") << "\n    {\"cidr\": \"" << slowest.entries[i].first
+                 << "\", \"counters\": " << slowest.entries[i].second.toJson() << "}";
+    }
+    statsOut << (slowest.entries.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    std::cout << "Query statistics saved to " << opts.statsFile << std::endl;
+}
+
+template <typename Codec, typename Index>
+void serveQueries(const Index& ipIndex, const QueryOptions& opts) {
+    SlowQueries slowest;
+    if (!opts.listenAddress.empty()) {
+        runServer<Codec>(ipIndex, opts, slowest);
+    } else if (opts.batchFile.empty()) {
+        runInteractive<Codec>(ipIndex, opts, slowest);
+    } else {
+        runBatch<Codec>(ipIndex, opts, slowest);
+    }
+    if constexpr (IndexStats<Index>::enabled) writeQueryStats<Codec>(ipIndex, slowest, opts);
+}
+
+// 建立KDTree，按需保存快照，然后进入查询
+template <typename Codec, typename Tree>
+void buildAndServe(std::vector<typename Codec::Point>&& ips, const QueryOptions& opts) {
+    Tree ipTree;
+    ipTree.setThreads(opts.threads);
+    ipTree.build(std::move(ips));
+
+    if (!opts.snapshotOut.empty()) {
+        if (ipTree.save(opts.snapshotOut)) {
+            std::cout << "Snapshot saved to " << opts.snapshotOut << std::endl;
+        } else {
+            std::cerr << "Error: Cannot write snapshot " << opts.snapshotOut << std::endl;
+        }
+    }
+    serveQueries<Codec>(ipTree, opts);
+}
+
+#ifdef __linux__
+
+// 在外存KDTree上查询，结束后报告页缓存的命中情况
+template <typename Codec, typename Tree>
+void serveExternal(const Tree& ipTree, const QueryOptions& opts) {
+    serveQueries<Codec>(ipTree, opts);
+    KDPageCacheStats cache = ipTree.cacheStats();
+    std::cout << "Page cache: " << cache.hits << " hit(s), " << cache.misses << " miss(es), " << cache.pagesRead
+              << " page(s) read in " << cache.reads << " read(s), " << (ipTree.memoryBytes() >> 10) << " KiB resident" << std::endl;
+}
+
+// 分批解析地址列表，建立外存KDTree文件后进入查询，建树和查询的内存占用都以-m为上限
+template <typename Codec>
+void buildExternal(const MappedFile& inFile, const char* begin, const char* end, bool binary, const QueryOptions& opts) {
+    using Point = typename Codec::Point;
+    if (opts.snapshotOut.empty()) {
+        std::cerr << "Error: The external index needs a file, use -x ext -w <file>" << std::endl;
+        return;
+    }
+    if (!opts.statsFile.empty()) {
+        std::cerr << "Warning: query statistics are not supported for the external index" << std::endl;
+    }
+    // 每批读入的文本或地址不超过内存上限的1/8
+    size_t batchBytes = std::max<size_t>(size_t(1) << 20, (opts.memoryMB << 20) / 8);
+    IPBinaryStream<Codec> stream;
+    if (binary && !stream.open(begin, end - begin)) {
+        std::cerr << "Error: " << opts.inputFile << " is truncated or corrupt" << std::endl;
+        return;
+    }
+    const char* p = begin;
+    size_t skipped = 0;
+    // 解析过的输入随即释放，映射的文件不会整个留在内存中
+    auto source = [&](std::vector<Point>& batch) {
+        if (binary) {
+            bool more = stream.read(batch, batchBytes / sizeof(Point)) > 0;
+            inFile.release(begin, stream.position());
+            return more;
+        }
+        if (p >= end) return false;
+        // 文本按行对齐分块
+        const char* chunkEnd = p + std::min<size_t>(batchBytes, end - p);
+        const char* nl = static_cast<const char*>(std::memchr(chunkEnd, '\n', end - chunkEnd));
+        chunkEnd = nl ? nl + 1 : end;
+        size_t bad = 0;
+        batch = parseIPList<Codec>(p, chunkEnd, opts.threads, &bad);
+        skipped += bad;
+        inFile.release(begin, chunkEnd);
+        p = chunkEnd;
+        return true;
+    };
+
+    ExternalKDTree<typename Codec::Coord, Codec::K> ipTree;
+    ipTree.setMemoryLimit(opts.memoryMB << 20);
+    auto start = std::chrono::steady_clock::now();
+    bool built = ipTree.build(source, opts.snapshotOut);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (skipped > 0) {
+        std::cerr << "Warning: skipped " << skipped << " malformed line(s) in " << opts.inputFile << std::endl;
+    }
+    if (!built || stream.failed()) {
+        std::cerr << "Error: Cannot build external index " << opts.snapshotOut
+                  << (stream.failed() ? " (input is truncated or corrupt)" : "") << std::endl;
+        return;
+    }
+    std::cout << "External index saved to " << opts.snapshotOut << ": " << ipTree.size() << " IP(s), "
+              << ipTree.pageCount() << " page(s) in " << seconds << " s" << std::endl;
+    serveExternal<Codec>(ipTree, opts);
+}
+
+// 打开外存KDTree文件，坐标类型和维数与Codec不符时返回false
+template <typename Codec>
+bool runExternal(const QueryOptions& opts) {
+    ExternalKDTree<typename Codec::Coord, Codec::K> ipTree;
+    ipTree.setMemoryLimit(opts.memoryMB << 20);
+    if (!ipTree.open(opts.snapshotIn)) return false;
+    std::cout << "Opened IPv" << Codec::version << " external index " << opts.snapshotIn << ": "
+              << ipTree.size() << " IP(s) in " << ipTree.pageCount() << " page(s)" << std::endl;
+    if (!opts.statsFile.empty()) {
+        std::cerr << "Warning: query statistics are not supported for the external index" << std::endl;
+    }
+    serveExternal<Codec>(ipTree, opts);
+    return true;
+}
+
+#else
+
+template <typename Codec>
+void buildExternal(const MappedFile&, const char*, const char*, bool, const QueryOptions& opts) {
+    std::cerr << "Error: The external index is only supported on Linux (" << opts.snapshotOut << ")" << std::endl;
+}
+
+template <typename Codec>
+bool runExternal(const QueryOptions&) {
+    return false;
+}
+
+#endif
+
+// 解析地址列表并建立索引，然后进入交互或批量模式
+// 文本格式[begin, end)为首行之后的内容，二进制格式为包括文件头在内的整个文件
+template <typename Codec>
+void runQuery(const MappedFile& inFile, const char* begin, const char* end, bool binary, const QueryOptions& opts) {
+    if (opts.externalIndex) {
+        buildExternal<Codec>(inFile, begin, end, binary, opts);
+        return;
+    }
+
+    std::vector<typename Codec::Point> ips;
+    if (binary) {
+        if (!parseIPBinary<Codec>(begin, end - begin, opts.threads, ips)) {
+            std::cerr << "Error: " << opts.inputFile << " is truncated or corrupt" << std::endl;
+            return;
+        }
+    } else {
+        size_t skipped = 0;
+        ips = parseIPList<Codec>(begin, end, opts.threads, &skipped);
+        if (skipped > 0) {
+            std::cerr << "Warning: skipped " << skipped << " malformed line(s) in " << opts.inputFile << std::endl;
+        }
+    }
+
+    if (opts.sortedIndex) {
+        SortedIPIndex<typename Codec::Coord, Codec::K> ipIndex;
+        ipIndex.setThreads(opts.threads);
+        ipIndex.build(std::move(ips));
+        if (!opts.snapshotOut.empty()) {
+            std::cerr << "Warning: snapshots are only supported for the KDTree index" << std::endl;
+        }
+        if (!opts.statsFile.empty()) {
+            std::cerr << "Warning: query statistics are only supported for the KDTree index" << std::endl;
+        }
+        serveQueries<Codec>(ipIndex, opts);
+        return;
+    }
+
+    if (opts.statsFile.empty()) {
+        buildAndServe<Codec, StaticKDTree<typename Codec::Coord, Codec::K>>(std::move(ips), opts);
+    } else {
+        buildAndServe<Codec, StaticKDTree<typename Codec::Coord, Codec::K, KDQueryStats>>(std::move(ips), opts);
+    }
+}
+
+// 从快照文件启动，Tree为是否记录查询统计的StaticKDTree
+template <typename Codec, typename Tree>
+bool serveSnapshot(const QueryOptions& opts) {
+    Tree ipTree;
+    auto start = std::chrono::steady_clock::now();
+    if (!ipTree.load(opts.snapshotIn)) return false;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Loaded IPv" << Codec::version << " snapshot " << opts.snapshotIn << ": "
+              << ipTree.size() << " IP(s) in " << ms << " ms" << std::endl;
+    serveQueries<Codec>(ipTree, opts);
+    return true;
+}
+
+// 快照的坐标类型和维数与Codec不符时返回false
+template <typename Codec>
+bool runSnapshot(const QueryOptions& opts) {
+    if (opts.statsFile.empty()) return serveSnapshot<Codec, StaticKDTree<typename Codec::Coord, Codec::K>>(opts);
+    return serveSnapshot<Codec, StaticKDTree<typename Codec::Coord, Codec::K, KDQueryStats>>(opts);
+}
+
+// 解析非负整数参数，不是十进制数或超出范围时返回false
+inline bool parseCount(const std::string& text, size_t limit, size_t& value) {
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    try {
+        size_t used = 0;
+        unsigned long long parsed = std::stoull(text, &used);
+        if (used != text.size() || parsed > limit) return false;
+        value = static_cast<size_t>(parsed);
+        return true;
+    } catch (const std::logic_error&) {
+        return false;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    QueryOptions opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            size_t threads = 0;
+            if (!parseCount(argv[++i], std::numeric_limits<unsigned>::max(), threads)) {
+                std::cerr << "Error: Invalid thread count " << argv[i] << std::endl;
+                return 1;
+            }
+            opts.threads = static_cast<unsigned>(threads);
+        } else if (arg == "-b" && i + 1 < argc) {
+            opts.batchFile = argv[++i];
+        } else if (arg == "-g") {
+            opts.groupQueries = true;
+        } else if (arg == "-c") {
+            opts.countOnly = true;
+        } else if (arg == "-k" && i + 1 < argc) {
+            opts.packedKeys = std::string(argv[++i]) != "bytes";
+        } else if (arg == "-w" && i + 1 < argc) {
+            opts.snapshotOut = argv[++i];
+        } else if (arg == "-r" && i + 1 < argc) {
+            opts.snapshotIn = argv[++i];
+        } else if (arg == "-i" && i + 1 < argc) {
+            opts.inputFile = argv[++i];
+        } else if (arg == "-f" && i + 1 < argc) {
+            opts.binaryOutput = std::string(argv[++i]) == "bin";
+        } else if (arg == "-x" && i + 1 < argc) {
+            std::string index = argv[++i];
+            if (index != "kd" && index != "sorted" && index != "ext") {
+                std::cerr << "Error: Unknown index " << index << ", use -x kd, -x sorted or -x ext" << std::endl;
+                return 1;
+            }
+            opts.sortedIndex = index == "sorted";
+            opts.externalIndex = index == "ext";
+        } else if (arg == "-s" && i + 1 < argc) {
+            opts.statsFile = argv[++i];
+        } else if (arg == "-l" && i + 1 < argc) {
+            opts.listenAddress = argv[++i];
+        } else if (arg == "-m" && i + 1 < argc) {
+            size_t memoryMB = 0;
+            if (!parseCount(argv[++i], std::numeric_limits<size_t>::max() >> 20, memoryMB) || memoryMB == 0) {
+                std::cerr << "Error: Invalid memory limit " << argv[i] << ", use a positive number of MB" << std::endl;
+                return 1;
+            }
+            opts.memoryMB = memoryMB;
+        }
+    }
+
+    // 快照文件头记录了坐标类型和维数，依次尝试各种IP版本和地址表示
+    if (!opts.snapshotIn.empty()) {
+        if (runSnapshot<IPv4PackedCodec>(opts) || runSnapshot<IPv4ByteCodec>(opts)
+            || runSnapshot<IPv6PackedCodec>(opts) || runSnapshot<IPv6ByteCodec>(opts)
+            || runExternal<IPv4PackedCodec>(opts) || runExternal<IPv4ByteCodec>(opts)
+            || runExternal<IPv6PackedCodec>(opts) || runExternal<IPv6ByteCodec>(opts)) {
+            return 0;
+        }
+        std::cerr << "Error: Cannot load snapshot " << opts.snapshotIn << std::endl;
+        return 1;
+    }
+
+    // 映射整个地址列表文件，直接在文件内容上解析
+    MappedFile inFile;
+    if (!inFile.open(opts.inputFile)) {
+        std::cerr << "Error: Cannot open " << opts.inputFile << std::endl;
+        return 1;
+    }
+    const char* begin = inFile.data();
+    const char* end = begin + inFile.size();
+
+    // 二进制文件按魔数识别，IP版本在文件头中；文本文件的首行代表IP版本
+    bool binary = isIPBinary(begin, inFile.size());
+    int version = 0;
+    const char* body = begin;
+    if (binary) {
+        IPBinaryHeader header;
+        if (!readIPBinaryHeader(begin, inFile.size(), header) || header.encoding == IP_GROUPED) {
+            std::cerr << "Error: Unsupported binary header in " << opts.inputFile << std::endl;
+            return 1;
+        }
+        version = header.ipVersion;
+    } else {
+        const char* firstLineEnd = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        if (!firstLineEnd) firstLineEnd = end;
+        version = std::atoi(std::string(begin, firstLineEnd).c_str());
+        body = firstLineEnd < end ? firstLineEnd + 1 : end;
+    }
+
+    if (version == 4) {
+        std::cout << "Detected IPv4 mode. Loading searching tree may take a while..." << std::endl;
+        if (opts.packedKeys) runQuery<IPv4PackedCodec>(inFile, body, end, binary, opts);
+        else runQuery<IPv4ByteCodec>(inFile, body, end, binary, opts);
+    } else if (version == 6) {
+        std::cout << "Detected IPv6 mode. Loading searching tree may take a while..." << std::endl;
+        if (opts.packedKeys) runQuery<IPv6PackedCodec>(inFile, body, end, binary, opts);
+        else runQuery<IPv6ByteCodec>(inFile, body, end, binary, opts);
+    } else {
+        std::cerr << "Unsupported version in first line: " << version << std::endl;
+        return 1;
+    }
+
+    return 0;
+}